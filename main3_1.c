@@ -22,6 +22,7 @@
 #include <fcntl.h>
 #include <poll.h>
 #include <stdint.h>
+#include <time.h>
 #include <sys/ioctl.h>
 #include <linux/spi/spidev.h>
 
@@ -35,7 +36,7 @@
 #define GP_IO2_MUX 31  //GPIO31 corresponds to MUX controlling IO2
 #define GP_IO3_MUX 30  //GPIO30 corresponds to MUX controlling IO2
 #define MAX_BUF 64
-#define CPU_CLOCK_SPEED 400000000.00 //400 MHz
+#define SPEED_OF_SOUND_CM_PER_NS 0.0000343 //343 m/s
 #define GPIO_DIRECTION_IN 1
 #define GPIO_DIRECTION_OUT 0
 #define GPIO_VALUE_LOW 0
@@ -76,24 +77,16 @@ typedef unsigned long long u64;
 typedef unsigned long      u32;
 
 /***********************************************************************
- * rdtsc() function is used to calulcate the number of clock ticks
- * and measure the time. TSC(time stamp counter) is incremented 
- * every cpu tick (1/CPU_HZ).
+ * monotonic_ns() function is used to measure the time in nanoseconds.
+ * CLOCK_MONOTONIC is calibrated by the kernel, so unlike the TSC it does
+ * not depend on the CPU clock speed of the board.
  **********************************************************************/
-static inline u64 rdtsc(void)
+static inline u64 monotonic_ns(void)
 {
-	if (sizeof(long) == sizeof(u64))
-	{
-		u32 lo, hi;
-		asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
-		return ((u64)(hi) << 32) | lo;
-	}
-	else
-	{
-		u64 tsc;
-		asm volatile("rdtsc" : "=A" (tsc));
-		return tsc;
-	}
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
 /***********************************************************************
@@ -688,7 +681,7 @@ void *thread_Ultrasonic_distance(void *data)
 		{
 			if(poll_io3.revents & POLLPRI)
 			{
-				timeRising = rdtsc();
+				timeRising = monotonic_ns();
 				retValue = read(poll_io3.fd, buf, 1);
 				if(retValue > 0)
 				{
@@ -718,7 +711,7 @@ void *thread_Ultrasonic_distance(void *data)
 		{
 			if(poll_io3.revents & POLLPRI)
 			{
-				timeFalling = rdtsc();
+				timeFalling = monotonic_ns();
 				retValue = read(poll_io3.fd, buf, 1);
 				if(retValue > 0)
 				{
@@ -732,7 +725,7 @@ void *thread_Ultrasonic_distance(void *data)
 		usleep(500000);
 
 		pthread_mutex_lock(&mutex);
-		distance = ((timeFalling - timeRising) * 340.00) / (2.0 * 4000000);
+		distance = ((timeFalling - timeRising) * SPEED_OF_SOUND_CM_PER_NS) / 2.0;
 
 		pthread_mutex_unlock(&mutex);
 	}
@@ -19,12 +19,18 @@
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include "spi_led.h"
+#include "pulse.h"
 
 /**
  * Define constants using the macro
  */ 
-#define SPI_DEVICE_NAME "/dev/spidev"
-#define PULSE_DEVICE_NAME "/dev/pulse"
+#define SPI_DEVICE_NAME "/dev/spidev1.0"
+#define PULSE_DEVICE_NAME "/dev/pulse0"
 
 /**
 * Thread Arguments
@@ -43,6 +49,9 @@ pthread_mutex_t mutex;
 
 double distance;
 
+char *spi_led_mmap(int fd);
+int spi_led_wait(int fd);
+
 /***********************************************************************
 * thread_transmit_spi_dog - thread Function to send Dog display
 * @data: Thread Parameters
@@ -59,7 +68,7 @@ void *thread_transmit_spi_dog(void *data)
 	char new_direction = 'L', old_direction = 'L';
 	unsigned int timeToDisplay = 0;
 	unsigned int sequenceBuffer[4];
-	char patternBuffer[4][8] = {
+	char patternBuffer[SPI_LED_PATTERNS][SPI_LED_ROWS] = {
 		{0x08, 0x90, 0xf0, 0x10, 0x10, 0x37, 0xdf, 0x98},
 		{0x20, 0x10, 0x70, 0xd0, 0x10, 0x97, 0xff, 0x18},
 		{0x98, 0xdf, 0x37, 0x10, 0x10, 0xf0, 0x90, 0x08},
@@ -121,14 +130,16 @@ void *thread_transmit_spi_dog(void *data)
 			sequenceBuffer[2] = 0;
 			sequenceBuffer[3] = 0;
 			
-			spi_led_write(fd, sequenceBuffer);
+			spi_led_write(fd, sequenceBuffer, sizeof(sequenceBuffer));
+			spi_led_wait(fd);
 
 			sequenceBuffer[0] = 1;
 			sequenceBuffer[1] = timeToDisplay;
 			sequenceBuffer[2] = 0;
 			sequenceBuffer[3] = 0;
 			
-			spi_led_write(fd, sequenceBuffer);
+			spi_led_write(fd, sequenceBuffer, sizeof(sequenceBuffer));
+			spi_led_wait(fd);
 		}
 		else if(new_direction == 'L')
 		{
@@ -138,14 +149,16 @@ void *thread_transmit_spi_dog(void *data)
 			sequenceBuffer[2] = 0;
 			sequenceBuffer[3] = 0;
 			
-			spi_led_write(fd, sequenceBuffer);
+			spi_led_write(fd, sequenceBuffer, sizeof(sequenceBuffer));
+			spi_led_wait(fd);
 			
 			sequenceBuffer[0] = 3;
 			sequenceBuffer[1] = timeToDisplay;
 			sequenceBuffer[2] = 0;
 			sequenceBuffer[3] = 0;
 			
-			spi_led_write(fd, sequenceBuffer);
+			spi_led_write(fd, sequenceBuffer, sizeof(sequenceBuffer));
+			spi_led_wait(fd);
 		}
 		distance_previous = distance_current;
 		old_direction = new_direction;
@@ -173,7 +186,6 @@ void *thread_transmit_spi_number(void *data)
 {
 	int retValue,fd;
 	int i,j,k;
-	int leftNumber = 0, rightNumber = 0;
 	ThreadParams *tparams = (ThreadParams*)data;
 	double distance_previous = distance, distance_current = distance, distance_diff = 0;
 	char numberBuffer[10][4] = {
@@ -188,7 +200,8 @@ void *thread_transmit_spi_number(void *data)
 		{0x6e, 0x91, 0x91, 0x6e},
 		{0x8e, 0x91, 0x91, 0x7e},
 		};
-	char tempBuffer[8];
+	unsigned int counterHandle[100];
+	struct spi_led_pattern_io patternIo;
 	unsigned int sequenceBuffer[4];
 	//printf("thread_transmit_spi Start\n");
 
@@ -202,6 +215,22 @@ void *thread_transmit_spi_number(void *data)
 	{
 		//printf("fd_spi device opened succcessfully.\n");
 	}
+	
+	//Upload all the counter values once, each one as its own pattern
+	for(i=0;i<100;i++)
+	{
+		if(ioctl(fd, SPI_LED_IOC_ALLOC, &counterHandle[i]) < 0)
+		{
+			perror("SPI LED ALLOC ERROR is : ");
+			close(fd);
+			return 0;
+		}
+		patternIo.handle = counterHandle[i];
+		patternIo.module = 0;
+		memcpy(&patternIo.rows[0], numberBuffer[i/10], 4);
+		memcpy(&patternIo.rows[4], numberBuffer[i%10], 4);
+		ioctl(fd, SPI_LED_IOC_SET_PATTERN, &patternIo);
+	}
 	sleep(1);
 	while(1)
 	{
@@ -213,22 +242,7 @@ void *thread_transmit_spi_number(void *data)
 			distance_diff = distance_current - distance_previous;
 			printf("Distance = %0.2f cm \n",distance_current);
 		
-			rightNumber = i%10;
-			leftNumber = i/10;
-			
-			tempBuffer[0] = numberBuffer[leftNumber][0];
-			tempBuffer[1] = numberBuffer[leftNumber][1];
-			tempBuffer[2] = numberBuffer[leftNumber][2];
-			tempBuffer[3] = numberBuffer[leftNumber][3];
-
-			tempBuffer[4] = numberBuffer[rightNumber][0];
-			tempBuffer[5] = numberBuffer[rightNumber][1];
-			tempBuffer[6] = numberBuffer[rightNumber][2];
-			tempBuffer[7] = numberBuffer[rightNumber][3];
-
-			spi_led_ioctl(fd,tempBuffer);
-			
-			sequenceBuffer[0] = 0;
+			sequenceBuffer[0] = counterHandle[i];
 			if(distance_current > 200)
 			{
 				sequenceBuffer[1] = 1000;
@@ -244,11 +258,17 @@ void *thread_transmit_spi_number(void *data)
 			sequenceBuffer[2] = 0;
 			sequenceBuffer[3] = 0;
 			
-			spi_led_write(fd, sequenceBuffer);
+			//One sequence in flight, so the next digit follows the distance
+			spi_led_write(fd, sequenceBuffer, sizeof(sequenceBuffer));
+			spi_led_wait(fd);
 			usleep(10000);
 		}
 	}
 	//printf("thread_transmit_spi fd = %d\n",fd);
+	for(i=0;i<100;i++)
+	{
+		ioctl(fd, SPI_LED_IOC_FREE, &counterHandle[i]);
+	}
 	close(fd);
 	pthread_exit(0);
 }
@@ -285,7 +305,7 @@ void *thread_transmit_spi_distance_number(void *data)
 		{0x6e, 0x91, 0x91, 0x6e},
 		{0x8e, 0x91, 0x91, 0x7e},
 		};
-	char tempBuffer[8];
+	char *patternBank;
 	unsigned int sequenceBuffer[4];
 	//printf("thread_transmit_spi Start\n");
 
@@ -299,6 +319,12 @@ void *thread_transmit_spi_distance_number(void *data)
 	{
 		//printf("fd_spi device opened succcessfully.\n");
 	}
+	patternBank = spi_led_mmap(fd);
+	if(patternBank == NULL)
+	{
+		close(fd);
+		return 0;
+	}
 	
 	while(1)
 	{
@@ -321,28 +347,22 @@ void *thread_transmit_spi_distance_number(void *data)
 				leftNumber = (int)distance_current/10;
 			}
 			
-			tempBuffer[0] = numberBuffer[leftNumber][0];
-			tempBuffer[1] = numberBuffer[leftNumber][1];
-			tempBuffer[2] = numberBuffer[leftNumber][2];
-			tempBuffer[3] = numberBuffer[leftNumber][3];
-
-			tempBuffer[4] = numberBuffer[rightNumber][0];
-			tempBuffer[5] = numberBuffer[rightNumber][1];
-			tempBuffer[6] = numberBuffer[rightNumber][2];
-			tempBuffer[7] = numberBuffer[rightNumber][3];
-
-			spi_led_ioctl(fd,tempBuffer);
+			//Update pattern 0 in place and let the driver pick it up
+			memcpy(&patternBank[0], numberBuffer[leftNumber], 4);
+			memcpy(&patternBank[4], numberBuffer[rightNumber], 4);
+			ioctl(fd, SPI_LED_IOC_COMMIT, 0);
 			
 			sequenceBuffer[0] = 0;
 			sequenceBuffer[1] = 1000;
 			sequenceBuffer[2] = 0;
 			sequenceBuffer[3] = 0;
 			
-			spi_led_write(fd, sequenceBuffer);
+			spi_led_write(fd, sequenceBuffer, sizeof(sequenceBuffer));
 			usleep(10000);
 		}
 	}
 	//printf("thread_transmit_spi fd = %d\n",fd);
+	munmap(patternBank, SPI_LED_PATTERNS * SPI_LED_ROWS);
 	close(fd);
 	pthread_exit(0);
 }
@@ -391,7 +411,7 @@ void *thread_transmit_spi_user(void *data)
 		//printf("fd_spi device opened succcessfully.\n");
 	}
 	
-	retValue = spi_led_ioctl(fd, patternBuffer, sizeof(patternBuffer));
+	retValue = spi_led_ioctl(fd, patternBuffer);
 	while(1)
 	{
 		retValue = spi_led_write(fd, sequenceBuffer, sizeof(sequenceBuffer));
@@ -410,21 +430,24 @@ void *thread_transmit_spi_user(void *data)
 * Returns NULL
 * 
 * Description:  Thread Function to measure the distance using the
-* 			 pulsewidth obtained from sensor. Multiplying the pulsewidth
-* 			with 0.017 gives the distance measured in cm.
+* 			 sample obtained from sensor. The driver reports the
+* 			distance in mm.
 ***********************************************************************/
 void *thread_Ultrasonic_distance(void *data)
 {
 	int fd;
-	int pulseWidth;
+	int distanceMm;
 	fd = open(PULSE_DEVICE_NAME, O_RDWR);
 	while(1)
 	{
 		write_pulse(fd);
-		pulseWidth = read_pulse(fd);
-		pthread_mutex_lock(&mutex);
-		distance = pulseWidth * 0.017;
-		pthread_mutex_unlock(&mutex);
+		distanceMm = read_pulse(fd);
+		if(distanceMm >= 0)
+		{
+			pthread_mutex_lock(&mutex);
+			distance = distanceMm / 10.0;
+			pthread_mutex_unlock(&mutex);
+		}
 		usleep(100000);
 	}
 	close(fd);
@@ -536,35 +559,48 @@ int write_pulse(int fd)
 }
 
 /***********************************************************************
-* read_pulse - Function to read pulsewidth measured from sensor.
+* read_pulse - Function to read the distance measured from sensor.
 * @fd: File Descriptor
 *
-* Returns negative errno, or else the number of success of read.
+* Returns the filtered distance in mm, or -1 if there was no echo.
 * 
-* Description: Function to read pulsewidth measured from sensor. This
-* function makes a system call to read function of pulse.c
+* Description: Function to read the distance measured from sensor. This
+* function makes a system call to read function of pulse.c, which
+* blocks until the echo has been measured. Samples already seen are
+* skipped.
 ***********************************************************************/
 int read_pulse(int fd)
 {
-	int retValue=0, count=0;
-    unsigned int writeBuffer =0;
+	static unsigned int lastSeq = 0;
+	int retValue=0;
+	struct pulse_sample sample;
 	while(1)
 	{
-		retValue = read(fd, &writeBuffer, sizeof(writeBuffer));
+		retValue = read(fd, &sample, sizeof(sample));
 		
-		if(retValue < 0)
+		if(retValue < 0 && errno == ETIMEDOUT)
+		{
+			//No sample, the trigger was not taken
+			return -1;
+		}
+		else if(retValue < 0)
 		{
 			//printf("Read Failure\n");
 			//perror("PULSE Read ERROR is : ");
 		}
-		else
+		else if(sample.seq != lastSeq)
 		{
 			//printf("Read Successful\n");
+			lastSeq = sample.seq;
 			break;
 		}
-		usleep(100000);
 	}
-	return writeBuffer;
+	if(sample.flags & PULSE_SAMPLE_NO_ECHO)
+	{
+		//No echo, the object is out of range
+		return -1;
+	}
+	return sample.filtered_mm;
 }
 
 
@@ -573,33 +609,52 @@ int read_pulse(int fd)
 * @fd: File Descriptor
 * @sequenceBuffer: Order of pattern and time for each pattern to be 
 * 					passed.
+* @size: Size of sequenceBuffer in bytes
 *
 * Returns success or failure of the write.
 * 
 * Description: Function to write a sequence of pattern onto LED. This
-* function makes a system call to write function of spi_led.c
+* function makes a system call to write function of spi_led.c. The
+* driver queues the sequence, so the call only blocks while its queue
+* is full.
 ***********************************************************************/
-int spi_led_write(int fd, unsigned int sequenceBuffer[20])
+int spi_led_write(int fd, unsigned int *sequenceBuffer, size_t size)
 {
-	int retValue=0, count=0;
-	while(1)
+	int retValue=0;
+	retValue = write(fd, sequenceBuffer, size);
+	if(retValue < 0)
 	{
-		retValue = write(fd, sequenceBuffer, sizeof(sequenceBuffer));
-		if(retValue < 0)
-		{
-			//printf("SPI LED Write Failure\n");
-			//perror("SPI LED ERROR is : ");
-		}
-		else
-		{
-			//printf("SPI LED Write Successful\n");
-			break;
-		}
-		usleep(100000);
+		perror("SPI LED ERROR is : ");
 	}
 	return retValue;
 }
 
+/***********************************************************************
+* spi_led_wait - Function to wait until a sequence has finished playing.
+* @fd: File Descriptor
+*
+* Returns the number of sequences finished, or -1 on failure.
+* 
+* Description: Function to wait until a sequence has finished playing.
+* It sleeps in poll() until the driver raises POLLIN and reads the
+* number of sequences finished since the previous read(), so that a
+* thread keeps at most one sequence queued and its next one uses the
+* latest distance.
+***********************************************************************/
+int spi_led_wait(int fd)
+{
+	struct pollfd pollFd;
+	unsigned int finished = 0;
+	pollFd.fd = fd;
+	pollFd.events = POLLIN;
+	if(poll(&pollFd, 1, -1) < 0 || read(fd, &finished, sizeof(finished)) < 0)
+	{
+		perror("SPI LED WAIT ERROR is : ");
+		return -1;
+	}
+	return finished;
+}
+
 /***********************************************************************
 * spi_led_ioctl - Function to send pattern to buffer of driver.
 * @fd: File Descriptor
@@ -615,9 +670,14 @@ int spi_led_write(int fd, unsigned int sequenceBuffer[20])
 int spi_led_ioctl(int fd, char patternBuffer[10][8])
 {
 	int retValue=0, count=0;
+	struct spi_led_patterns patterns;
+	//A single module, SPI_LED_ROWS bytes per pattern
+	memset(&patterns, 0, sizeof(patterns));
+	patterns.len = SPI_LED_PATTERNS * SPI_LED_ROWS;
+	patterns.ptr = (unsigned long)patternBuffer;
 	while(1)
 	{
-		retValue = ioctl(fd, patternBuffer, sizeof(patternBuffer));
+		retValue = ioctl(fd, SPI_LED_IOC_SET_PATTERNS, &patterns);
 		if(retValue < 0)
 		{
 			printf("SPI LED IOCTL Failure\n");
@@ -631,3 +691,25 @@ int spi_led_ioctl(int fd, char patternBuffer[10][8])
 	}
 	return retValue;
 }
+
+/***********************************************************************
+* spi_led_mmap - Function to map the pattern bank of the driver.
+* @fd: File Descriptor
+*
+* Returns pointer to the pattern bank, or NULL on failure.
+* 
+* Description: Function to map the pattern bank of spi_led.c. Pattern N
+* starts at byte N * SPI_LED_ROWS. After a pattern is changed in place,
+* the SPI_LED_IOC_COMMIT ioctl makes the driver load it.
+***********************************************************************/
+char *spi_led_mmap(int fd)
+{
+	char *patternBank;
+	patternBank = mmap(NULL, SPI_LED_PATTERNS * SPI_LED_ROWS, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(patternBank == MAP_FAILED)
+	{
+		perror("SPI LED mmap ERROR is : ");
+		return NULL;
+	}
+	return patternBank;
+}
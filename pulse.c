@@ -28,13 +28,42 @@
 #include <linux/irq.h>
 #include <asm/errno.h>
 #include <linux/math64.h>
+#include <linux/kthread.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/uaccess.h>
+#include <linux/wait.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/seqlock.h>
+#include <linux/version.h>
+#include "pulse.h"
+
+/**
+ * The IIO interface needs IIO_DISTANCE and iio_device_claim_direct_mode()
+ * of 4.7, and the driver_module of iio_info that is gone in 4.13. Other
+ * kernels, like the 3.8 kernel of the Galileo SDK, build the driver
+ * without it.
+ */
+#if IS_ENABLED(CONFIG_IIO_TRIGGERED_BUFFER) && LINUX_VERSION_CODE >= KERNEL_VERSION(4,7,0) && LINUX_VERSION_CODE < KERNEL_VERSION(4,13,0)
+#define PULSE_IIO
+#include <linux/iio/iio.h>
+#include <linux/iio/buffer.h>
+#include <linux/iio/trigger.h>
+#include <linux/iio/trigger_consumer.h>
+#include <linux/iio/triggered_buffer.h>
+#endif
 
 /**
  * Define constants using the macro
  */
 #define DRIVER_NAME 		"pulse"
-#define DEVICE_NAME 		"pulse"
-#define PULSE_MINOR_NUMBER 	0
+#define DEVICE_NAME 		"pulse%d"
+#define PULSE_MAX_SENSORS 	8
 #define GP_IO2 14  			//GPIO14 corresponds to IO2
 #define GP_IO3 15  			//GPIO15 corresponds to IO3
 #define GP_IO2_MUX 31  		//GPIO31 corresponds to MUX controlling IO2
@@ -43,11 +72,25 @@
 #define GPIO_DIRECTION_OUT 0
 #define GPIO_VALUE_LOW 0
 #define GPIO_VALUE_HIGH 1
-#define RISE_DETECTION 0
-#define FALL_DETECTION 1
+#define PULSE_READ_TIMEOUT_MS 200	/* Longest blocking read() without an echo, past the trigger period */
+#define PULSE_ECHO_TIMEOUT_MS 50	/* Past the 38 ms no-echo pulse of the sensor */
+#define PULSE_NS_TO_MM_MULT 736587ULL	/* 0.1715 mm/us (343 m/s, both ways) * 2^32 / 1000 */
+#define PULSE_NS_TO_MM_SHIFT 32
 static dev_t pulse_dev_number;      /* Allotted Device Number */
 static struct class *pulse_class;   /* Device class */
-static unsigned char Edge = RISE_DETECTION;
+
+/**
+ * One trigger/echo GPIO pair per sensor, sensor N is /dev/pulseN.
+ * e.g. "insmod pulse.ko trigger_gpios=14,0 echo_gpios=15,1"
+ */
+static int trigger_gpios[PULSE_MAX_SENSORS] = { GP_IO2 };
+static int echo_gpios[PULSE_MAX_SENSORS] = { GP_IO3 };
+static int n_trigger_gpios = 1;
+static int n_echo_gpios = 1;
+module_param_array(trigger_gpios, int, &n_trigger_gpios, S_IRUGO);
+MODULE_PARM_DESC(trigger_gpios, "Trigger GPIO of each sensor");
+module_param_array(echo_gpios, int, &n_echo_gpios, S_IRUGO);
+MODULE_PARM_DESC(echo_gpios, "Echo GPIO of each sensor");
 
 /**
  * per device structure
@@ -56,18 +99,109 @@ typedef struct Pulse_Device_Tag
 {
 	struct cdev cdev;               /* The cdev structure */
 	char name[20];                  /* Name of device */
+	int index;						/* Sensor number, also the minor number */
+	int trigger_gpio;
+	int echo_gpio;
 	unsigned int BUSY_FLAG;		  	/* Busy Flag Status */
-	unsigned long long timeRising;		/* TimeStamp to record Start Time */
-	unsigned long long timeFalling;		/* TimeStamp to record End Time */
+	unsigned long long timeTrigger;		/* Time of the trigger pulse, in ns */
+	unsigned long long timeRising;		/* TimeStamp to record Start Time, in ns */
+	unsigned long long timeFalling;		/* TimeStamp to record End Time, in ns */
+	unsigned long long tickRising;		/* TSC at the rising edge */
+	unsigned long long tickFalling;		/* TSC at the falling edge */
+	unsigned long long raw_ticks;		/* TSC ticks of the last echo */
+	unsigned long long width_ns;		/* Length of the last echo */
 	int irq;
+	unsigned int mode;				/* PULSE_MODE_* */
+	unsigned int period_ms;			/* Trigger period in free-running mode */
+	struct pulse_adaptive adaptive;	/* Policy of the adaptive mode, under lock */
+	unsigned int adapt_period_ms;	/* Trigger period in adaptive mode */
+	unsigned int adapt_armed;		/* adapt_ref_mm holds a sample */
+	unsigned int adapt_ref_mm;		/* Filtered distance of the last sample */
+	ktime_t last_trigger;			/* Last trigger in adaptive mode */
+	wait_queue_head_t read_wq;		/* Readers waiting for a measurement */
+	spinlock_t lock;				/* Protects BUSY_FLAG against the echo timer */
+	struct hrtimer echo_timer;		/* Ends a measurement that gets no echo */
+	struct pulse_sample latest;		/* Last measurement pushed */
+	seqcount_t latest_seq;			/* Lets readers copy latest without a lock */
+	unsigned int trigger_pending;	/* A writer is waiting to trigger */
+	unsigned int users;				/* Open files */
+	unsigned int max_range_mm;		/* Range gate, 0 to wait for the full echo */
+	unsigned long long gate_ns;		/* Echo time of max_range_mm */
+	unsigned int guard_us;			/* Quiet time between two pings */
+	ktime_t ready_time;				/* Earliest time of the next trigger */
+	unsigned int gated;				/* Sample pushed by the range gate, echo still high */
+	struct pulse_filter filter;		/* Filter applied to the echoes */
+	unsigned int median_ring[PULSE_MEDIAN_MAX];	/* Last distances, oldest at median_next */
+	unsigned int median_sorted[PULSE_MEDIAN_MAX];	/* Same distances in ascending order */
+	unsigned int median_count;
+	unsigned int median_next;
+	long long ema;					/* Moving average of the distances, Q16 */
+	unsigned int filtered_mm;		/* Last filtered distance */
+	unsigned int seq;				/* Number of the last sample */
+	ktime_t next_due;				/* Next trigger in free-running mode */
+	unsigned long samples;			/* Measurements completed */
+	unsigned int rate_count;		/* Measurements in the current second */
+	ktime_t rate_start;				/* Start of the current second */
+	unsigned int rate;				/* Measurements in the last second */
+	struct pulse_ring *ring;		/* Sample ring mapped by user space */
+	struct list_head files;			/* Open files, under lock */
+#ifdef PULSE_IIO
+	struct iio_dev *iio;			/* IIO device of the sensor */
+	struct iio_trigger *iio_trig;	/* Fired on every sample with an echo */
+	unsigned int iio_started;		/* The IIO buffer started the free-running mode */
+	__u32 iio_seq;					/* Last sample pushed to the IIO buffer */
+#endif
 } Pulse_Device;
 
-Pulse_Device *pulse_dev;
+/**
+ * per open file structure
+ */
+typedef struct Pulse_File_Tag
+{
+	Pulse_Device *dev;				/* Sensor of the file */
+	struct pulse_ring_ctl *ctl;		/* Control page, mapped by user space */
+	__u32 cursor;					/* Ring position of the next sample to read */
+	struct mutex read_lock;			/* Serializes read() on the file */
+	struct list_head node;			/* Entry in the files of the sensor */
+	struct pulse_threshold threshold;	/* Events asked for, under dev->lock */
+	unsigned int armed;				/* band and ref_mm hold a sample */
+	unsigned int band;				/* Band of the last event */
+	unsigned int ref_mm;			/* Distance of the last event */
+	unsigned int event_pending;		/* event not fetched yet */
+	struct pulse_event event;		/* Last event */
+	struct fasync_struct *fasync;	/* SIGIO owners */
+} Pulse_File;
+
+static Pulse_Device *pulse_devs[PULSE_MAX_SENSORS];
+static int pulse_sensors;
+
+/**
+ * Only one sensor of the array pings at a time, so that a sensor never
+ * takes the echo of its neighbour for its own. pulse_active is the
+ * sensor waiting for its echo, pulse_array_ready the end of the guard
+ * time of the last measurement.
+ */
+static DEFINE_SPINLOCK(pulse_array_lock);
+static Pulse_Device *pulse_active;
+static ktime_t pulse_array_ready;
+static DECLARE_WAIT_QUEUE_HEAD(pulse_array_wq);
+
+/**
+ * Scheduler of the sensors in free-running mode
+ */
+static struct task_struct *pulse_scheduler;
+static DEFINE_MUTEX(pulse_sched_lock);
+
+/**
+ * Protects the users count of the sensors
+ */
+static DEFINE_MUTEX(pulse_open_lock);
 
 /**
  * rdtsc() function is used to calulcate the number of clock ticks
  * and measure the time. TSC(time stamp counter) is incremented 
- * every cpu tick (1/CPU_HZ).
+ * every cpu tick (1/CPU_HZ). Its rate depends on the board, so it is
+ * only reported in sysfs for debugging; measurements use ktime_get().
  * 
  * Source: http://www.mcs.anl.gov/~kazutomo/rdtsc.html
  */
@@ -79,305 +213,2059 @@ static __inline__ unsigned long long rdtsc(void)
 }
 
 /***********************************************************************
-* change_state_interrupt - This is Interrrupt Handler function.
-* @data: Thread Parameters
-*
-* Returns IRQ_HANDLED
+* pulse_filter_median - This function is used to add a distance to the
+* 	median window.
 * 
-* Description: This is Interrrupt Handler function. It checks for rising
-* 	and falling edges and notes down the time when rising edge arrived
-* 	and time when falling edge arrived.
+* @dev: Device Structure
+* @value: Distance in mm
+* 
+* Returns the median of the window
+* 
+* Description: The window is kept sorted, so adding a distance only moves
+* 	at most PULSE_MEDIAN_MAX entries.
 ***********************************************************************/
-static irqreturn_t change_state_interrupt(int irq, void *dev_id)
+static unsigned int pulse_filter_median(Pulse_Device *dev, unsigned int value)
 {
-	//printk("pulse.c change_state_interrupt Start\n");
-	if(Edge==RISE_DETECTION)
+	unsigned int i;
+	unsigned int old;
+
+	if(dev->median_count == dev->filter.window)
 	{
-		pulse_dev->timeRising = rdtsc();
-	    irq_set_irq_type(irq, IRQF_TRIGGER_FALLING);
-	    Edge=FALL_DETECTION;
+		//Drop the oldest distance from the sorted window
+		old = dev->median_ring[dev->median_next];
+		for(i = 0; dev->median_sorted[i] != old; i++)
+		{
+		}
+		for(; i < dev->median_count - 1; i++)
+		{
+			dev->median_sorted[i] = dev->median_sorted[i + 1];
+		}
+		dev->median_count--;
 	}
-	else
+	dev->median_ring[dev->median_next] = value;
+	dev->median_next = (dev->median_next + 1) % dev->filter.window;
+	
+	for(i = dev->median_count; i > 0 && dev->median_sorted[i - 1] > value; i--)
 	{
-		pulse_dev->timeFalling = rdtsc();
-	    irq_set_irq_type(irq, IRQF_TRIGGER_RISING);
-	    Edge=RISE_DETECTION;
-		pulse_dev->BUSY_FLAG = 0;
+		dev->median_sorted[i] = dev->median_sorted[i - 1];
 	}
-	//printk("pulse.c change_state_interrupt End\n");
-	return IRQ_HANDLED;
+	dev->median_sorted[i] = value;
+	dev->median_count++;
+	return dev->median_sorted[dev->median_count / 2];
 }
 
 /***********************************************************************
-* pulse_open - This is function that will be called when the device is
-* 	opened.
-* @inode: Inode structure
-* @filp: File Pointer
+* pulse_filter_sample - This function is used to run a distance through
+* 	the filter selected with PULSE_IOC_SET_FILTER.
 * 
-* Returns 0 on success
+* @dev: Device Structure
+* @value: Distance in mm
 * 
-* Description: This is function that will be called when the device is 
-* 	opened.
+* Returns the filtered distance in mm
 ***********************************************************************/
-int pulse_open(struct inode *inode, struct file *filp)
+static unsigned int pulse_filter_sample(Pulse_Device *dev, unsigned int value)
 {
-	int irq_line;
-	int irq_req_res_rising;
-	int retValue;
-	
-	//printk("pulse.c pulse_open() Start \n");
-	pulse_dev->BUSY_FLAG = 0;
-	
-	/* Get the per-device structure that contains this cdev */
-	pulse_dev = container_of(inode->i_cdev, Pulse_Device, cdev);
-	
-	/* Easy access to cmos_devp from rest of the entry points */
-	filp->private_data = pulse_dev;
-	
-	//Free the GPIO Pins
-	gpio_free(GP_IO2);
-	gpio_free(GP_IO3);
-	gpio_free(GP_IO2_MUX);
-	gpio_free(GP_IO3_MUX);
-	
-	//Set GPIO pins directions and values
-	gpio_request_one(GP_IO2_MUX, GPIOF_OUT_INIT_LOW , "gpio31");
-	gpio_request_one(GP_IO3_MUX, GPIOF_OUT_INIT_LOW , "gpio30");
-	gpio_request_one(GP_IO2, GPIOF_OUT_INIT_LOW , "gpio14");
-	gpio_request_one(GP_IO3, GPIOF_OUT_INIT_LOW , "gpio15");
-	
-	//Set GPIO pins values
-	gpio_set_value_cansleep(GP_IO2, GPIO_VALUE_LOW);
-	gpio_set_value_cansleep(GP_IO3, GPIO_VALUE_LOW);
-	gpio_set_value_cansleep(GP_IO2_MUX, GPIO_VALUE_LOW);
-	gpio_set_value_cansleep(GP_IO3_MUX, GPIO_VALUE_LOW);
-	
-	//printk("%s has opened\n", pulse_dev->name);
-	gpio_free(GP_IO3);
-	gpio_request_one(GP_IO3, GPIOF_IN , "gpio15");
-	
-	/*install interrupt handler*/
-	irq_line = gpio_to_irq(GP_IO3);
-	
-	if(irq_line < 0)
+	switch(dev->filter.type)
+	{
+	case PULSE_FILTER_MEDIAN:
+		return pulse_filter_median(dev, value);
+	case PULSE_FILTER_EMA:
+		if(dev->median_count == 0)
+		{
+			//The first distance starts the average
+			dev->ema = (long long)value << 16;
+			dev->median_count = 1;
+		}
+		else
+		{
+			dev->ema += ((((long long)value << 16) - dev->ema) * dev->filter.alpha) >> 16;
+		}
+		return (dev->ema + 0x8000) >> 16;
+	default:
+		return value;
+	}
+}
+
+/***********************************************************************
+* pulse_set_filter - This function is used to select the filter.
+* 
+* @dev: Device Structure
+* @filter: Filter settings from the user
+* 
+* Returns 0 on success, -EINVAL for bad settings
+***********************************************************************/
+static int pulse_set_filter(Pulse_Device *dev, struct pulse_filter *filter)
+{
+	unsigned long flags;
+
+	if(filter->type == PULSE_FILTER_MEDIAN &&
+		(filter->window == 0 || filter->window > PULSE_MEDIAN_MAX))
 	{
-		printk("Gpio %d cannot be used as interrupt",GP_IO3);
-		retValue=-EINVAL;
+		return -EINVAL;
 	}
-	pulse_dev->irq = irq_line;
-	
-	pulse_dev->timeRising=0;
-	pulse_dev->timeFalling=0;
-	
-	irq_req_res_rising = request_irq(irq_line, change_state_interrupt, IRQF_TRIGGER_RISING, "gpio_change_state", pulse_dev);
-	if(irq_req_res_rising)
+	if(filter->type == PULSE_FILTER_EMA &&
+		(filter->alpha == 0 || filter->alpha > PULSE_FILTER_ALPHA_ONE))
 	{
-		printk("Unable to claim irq %d; error %d\n ", irq_line, irq_req_res_rising);
-		return 0;
+		return -EINVAL;
 	}
-	
-	//printk("pulse.c pulse_open() End \n");
+	if(filter->type > PULSE_FILTER_EMA)
+	{
+		return -EINVAL;
+	}
+	spin_lock_irqsave(&dev->lock, flags);
+	dev->filter = *filter;
+	dev->median_count = 0;
+	dev->median_next = 0;
+	spin_unlock_irqrestore(&dev->lock, flags);
 	return 0;
 }
 
 /***********************************************************************
-* pulse_release - This is is used by the driver to close anything which 
-* 	has been opened and used during driver execution.
+* pulse_end_ping - This function is used to end the measurement of a
+* 	sensor and let the next sensor of the array ping.
 * 
-* @inode: Inode structure
-* @filp: File Pointer
+* @dev: Device Structure
 * 
-* Returns 0 on success
+* Returns -
 * 
-* Description: This is is used by the driver to close anything which 
-* 	has been opened and used during driver execution.
+* Description: Called with dev->lock held once the echo line of the
+* 	sensor is low again, or the echo timer expired. The guard time
+* 	starts here.
 ***********************************************************************/
-int pulse_release(struct inode *inode, struct file *filp)
+static void pulse_end_ping(Pulse_Device *dev)
 {
-	Pulse_Device *local_pulse_dev;
-	//printk("pulse.c pulse_release() Start\n");
-	
-	pulse_dev->BUSY_FLAG = 0;
-	local_pulse_dev = filp->private_data;
-	free_irq(pulse_dev->irq,pulse_dev);
-	
-	gpio_free(GP_IO2);
-	gpio_free(GP_IO3);
-	gpio_free(GP_IO2_MUX);
-	gpio_free(GP_IO3_MUX);
-	
-	printk("pulse_release -- %s is closing\n", local_pulse_dev->name);
-	//printk("pulse.c pulse_release() End\n");
-	return 0;
+	unsigned long flags;
+
+	dev->BUSY_FLAG = 0;
+	dev->gated = 0;
+	dev->ready_time = ktime_add_us(ktime_get(), dev->guard_us);
+	spin_lock_irqsave(&pulse_array_lock, flags);
+	if(pulse_active == dev)
+	{
+		pulse_active = NULL;
+		pulse_array_ready = dev->ready_time;
+	}
+	spin_unlock_irqrestore(&pulse_array_lock, flags);
+	wake_up_interruptible(&pulse_array_wq);
 }
 
 /***********************************************************************
-* pulse_write - This function is used to send the trigger pulse to the
-* 	sensor.
+* pulse_ring_push - This function is used to publish a sample in the
+* 	sample ring.
 * 
-* @filp: File Pointer
-* @buf: Buffer
-* @count: Size of Buffer
-* @ppos: Position Pointer
+* @dev: Device Structure
+* @sample: Sample to publish
 * 
-* Returns 0 on success
+* Returns -
 * 
-* Description: This function is used to send the trigger pulse to the
-* 	sensor.
+* Description: Called with dev->lock held, the driver is the only writer
+* 	of the ring. seq is cleared while the record is written so that a
+* 	consumer reading it at the same time can tell.
 ***********************************************************************/
-static ssize_t pulse_write(struct file *filp, const char *buf, size_t count, loff_t *ppos)
+static void pulse_ring_push(Pulse_Device *dev, struct pulse_sample *sample)
 {
-	int retValue = 0;
-	//printk("pulse.c pulse_write() Start\n");
-	
-	if(pulse_dev->BUSY_FLAG == 1)
+	struct pulse_ring *ring = dev->ring;
+	__u32 head = ring->head;
+	struct pulse_ring_record *record = &ring->records[head & (PULSE_RING_SIZE - 1)];
+
+	record->seq = 0;
+	smp_wmb();
+	record->sample = *sample;
+	smp_wmb();
+	record->seq = head + 1;
+	smp_wmb();
+	ring->head = head + 1;
+}
+
+/***********************************************************************
+* pulse_ring_read - This function is used to copy a sample out of the
+* 	sample ring without a lock.
+* 
+* @dev: Device Structure
+* @pos: Ring position of the sample
+* @sample: Copy of the sample
+* 
+* Returns 0 on success, -EAGAIN if the record was overwritten
+***********************************************************************/
+static int pulse_ring_read(Pulse_Device *dev, __u32 pos, struct pulse_sample *sample)
+{
+	struct pulse_ring_record *record = &dev->ring->records[pos & (PULSE_RING_SIZE - 1)];
+	__u32 seq;
+
+	seq = ACCESS_ONCE(record->seq);
+	smp_rmb();
+	*sample = record->sample;
+	smp_rmb();
+	if(seq != pos + 1 || ACCESS_ONCE(record->seq) != seq)
 	{
-		retValue = -EBUSY;
-		return -EBUSY;
+		return -EAGAIN;
 	}
-	
-	//Generate a trigger pulse
-	gpio_set_value_cansleep(GP_IO2, GPIO_VALUE_HIGH);
-	udelay(18);
-	gpio_set_value_cansleep(GP_IO2, GPIO_VALUE_LOW);
-	pulse_dev->BUSY_FLAG = 1;
-	//printk("pulse.c pulse_write() End\n");
-	return retValue;
+	return 0;
 }
 
 /***********************************************************************
-* pulse_read - This function is used by the user application to measure
-* 	the pulse width. That is it measures the distance of object from the
-* 	sensor.
+* pulse_band - This function is used to find the band of a distance.
 * 
-* @file: File Structure
-* @buf: Buffer
-* @count: Size of Buffer
-* @ptr: Position Pointer
+* @threshold: Band edges
+* @mm: Distance
 * 
-* Returns 0 on success
+* Returns the number of edges at or below the distance
+***********************************************************************/
+static unsigned int pulse_band(struct pulse_threshold *threshold, unsigned int mm)
+{
+	unsigned int band = 0;
+
+	while(band < threshold->edges && threshold->edge_mm[band] <= mm)
+	{
+		band++;
+	}
+	return band;
+}
+
+/***********************************************************************
+* pulse_check_thresholds - This function is used to raise the threshold
+* 	events of the files of a sensor.
 * 
-* Description: This function is used by the user application to measure
-* 	the pulse width. That is it measures the distance of object from the
-* 	sensor.
+* @dev: Device Structure
+* @sample: Sample just pushed
+* 
+* Returns -
+* 
+* Description: Called with dev->lock held. A file gets an event when
+* 	the filtered distance enters another band or moves delta_mm away
+* 	from the distance of its last event. Events not fetched yet are
+* 	replaced by the newer one and counted.
 ***********************************************************************/
-static ssize_t pulse_read(struct file *file, char *buf, size_t count, loff_t *ptr)
+static void pulse_check_thresholds(Pulse_Device *dev, struct pulse_sample *sample)
 {
-	int retValue=0;
-	unsigned int c;
-	unsigned long long tempBuffer;
-	//printk("pulse.c pulse_read() Start\n");
-	if(pulse_dev->BUSY_FLAG == 1)
+	Pulse_File *file;
+	unsigned int band;
+	unsigned int reason;
+	unsigned int mm = sample->filtered_mm;
+
+	if(sample->flags & PULSE_SAMPLE_NO_ECHO)
 	{
-		return -EBUSY;
+		return;
 	}
-	else
+	list_for_each_entry(file, &dev->files, node)
 	{
-		if(pulse_dev->timeRising == 0 && pulse_dev->timeFalling == 0)
+		if(file->threshold.edges == 0 && file->threshold.delta_mm == 0)
 		{
-			printk("Please Trigger the measure first\n");
+			continue;
 		}
-		else
+		band = pulse_band(&file->threshold, mm);
+		if(!file->armed)
+		{
+			file->armed = 1;
+			file->band = band;
+			file->ref_mm = mm;
+			continue;
+		}
+		reason = 0;
+		if(band != file->band)
 		{
-			tempBuffer = pulse_dev->timeFalling - pulse_dev->timeRising;
-			c = div_u64(tempBuffer,400);
-			retValue = copy_to_user((void *)buf, (const void *)&c, sizeof(c));
+			reason |= PULSE_EVENT_BAND;
 		}
+		if(file->threshold.delta_mm && (mm > file->ref_mm ? mm - file->ref_mm : file->ref_mm - mm) >= file->threshold.delta_mm)
+		{
+			reason |= PULSE_EVENT_DELTA;
+		}
+		if(reason == 0)
+		{
+			continue;
+		}
+		file->event.count = file->event_pending ? file->event.count + 1 : 1;
+		file->event.seq = sample->seq;
+		file->event.reason = reason;
+		file->event.band = band;
+		file->event.prev_band = file->band;
+		file->event.filtered_mm = mm;
+		file->event.timestamp_ns = sample->timestamp_ns;
+		file->event_pending = 1;
+		file->band = band;
+		file->ref_mm = mm;
+		kill_fasync(&file->fasync, SIGIO, POLL_PRI);
 	}
-	//printk("pulse.c pulse_read() End\n");
-	return retValue;
 }
 
-/**
- * File operations structure. Defined in linux/fs.h
- */
-static struct file_operations pulse_fops =
+/***********************************************************************
+* pulse_adapt_period - This function is used to adapt the trigger period
+* 	of the adaptive mode to the last sample.
+* 
+* @dev: Device Structure
+* @sample: Sample just pushed
+* 
+* Returns -
+* 
+* Description: Called with dev->lock held. A move of more than the
+* 	hysteresis brings the period down to min_period_ms at once and
+* 	wakes the scheduler so that the next ping is not held back by the
+* 	longer period. A still scene doubles the period, up to
+* 	max_period_ms.
+***********************************************************************/
+static void pulse_adapt_period(Pulse_Device *dev, struct pulse_sample *sample)
 {
-		.owner = THIS_MODULE,			/* Owner */
-		.open = pulse_open,             /* Open method */
-		.release = pulse_release,       /* Release method */
-		.write = pulse_write,           /* Write method */
-		.read = pulse_read				/* Read method */
-};
+	unsigned int mm = sample->filtered_mm;
+	unsigned int period = dev->adapt_period_ms;
+	int shorter;
+
+	if(dev->mode != PULSE_MODE_ADAPTIVE || (sample->flags & PULSE_SAMPLE_NO_ECHO))
+	{
+		return;
+	}
+	if(dev->adapt_armed && (mm > dev->adapt_ref_mm ? mm - dev->adapt_ref_mm : dev->adapt_ref_mm - mm) > dev->adaptive.hysteresis_mm)
+	{
+		period = dev->adaptive.min_period_ms;
+	}
+	else if(dev->adapt_armed)
+	{
+		period = min(period * 2, dev->adaptive.max_period_ms);
+	}
+	dev->adapt_armed = 1;
+	dev->adapt_ref_mm = mm;
+	shorter = period < dev->adapt_period_ms;
+	dev->adapt_period_ms = period;
+	if(shorter)
+	{
+		wake_up_process(pulse_scheduler);
+	}
+}
 
 /***********************************************************************
-* pulse_init - This function is called to initialize the Ultrasonic 
-* 	sensor.
+* pulse_push_sample - This function is used to queue the measurement that
+* 	just completed for read().
 * 
-* Returns 0 on success
+* @dev: Device Structure
+* @flags: PULSE_SAMPLE_* flags of the measurement
 * 
-* Description: This function is called to initialize the Ultrasonic 
-* 	sensor.
+* Returns -
+* 
+* Description: Called with dev->lock held from the interrupt handler on
+* 	the falling edge, or from the echo timer. Both run in hard interrupt
+* 	context under the lock, so the ring and latest have a single writer
+* 	and readers need no lock. It ends the measurement, wakes the
+* 	readers and fires the IIO trigger. The edge times are taken from
+* 	the monotonic clock in ns, the width is converted to mm with a
+* 	multiply and a shift.
 ***********************************************************************/
-static int __init pulse_init(void)
+static void pulse_push_sample(Pulse_Device *dev, unsigned int flags)
 {
-	int retValue;
-	//printk("pulse.c pulse_init() Start \n");
-	
-	/* Request dynamic allocation of a device major number */
-	if(alloc_chrdev_region(&pulse_dev_number, 0, PULSE_MINOR_NUMBER, DRIVER_NAME) < 0)
+	struct pulse_sample sample;
+
+	sample.version = PULSE_SAMPLE_VERSION;
+	sample.size = sizeof(sample);
+	sample.seq = ++dev->seq;
+	sample.timestamp_ns = ktime_to_ns(ktime_get());
+	sample.echo_ns = 0;
+	sample.distance_mm = 0;
+	if(!(flags & PULSE_SAMPLE_NO_ECHO))
 	{
-		printk("Can't register device\n");
-		return -1;
+		dev->width_ns = dev->timeFalling - dev->timeRising;
+		dev->raw_ticks = dev->tickFalling - dev->tickRising;
+		sample.timestamp_ns = dev->timeFalling;
+		sample.echo_ns = dev->width_ns;
+		sample.distance_mm = (dev->width_ns * PULSE_NS_TO_MM_MULT) >> PULSE_NS_TO_MM_SHIFT;
+		dev->filtered_mm = pulse_filter_sample(dev, sample.distance_mm);
 	}
+	sample.filtered_mm = dev->filtered_mm;
+	sample.flags = flags;
+	write_seqcount_begin(&dev->latest_seq);
+	dev->latest = sample;
+	write_seqcount_end(&dev->latest_seq);
+	pulse_ring_push(dev, &sample);
+	pulse_check_thresholds(dev, &sample);
+	pulse_adapt_period(dev, &sample);
 	
-	/* Populate sysfs entries */
-	pulse_class = class_create(THIS_MODULE, DRIVER_NAME);
-	
-	/* Allocate memory for the per-device structure pulse_dev */
-	pulse_dev = kmalloc(sizeof(Pulse_Device), GFP_KERNEL);
-	if(!pulse_dev)
+	dev->samples++;
+	dev->rate_count++;
+	if(ktime_to_ns(ktime_sub(ktime_get(), dev->rate_start)) >= NSEC_PER_SEC)
 	{
-		printk("Bad Kmalloc pulse_dev\n");
-		return -ENOMEM;
+		dev->rate = dev->rate_count;
+		dev->rate_count = 0;
+		dev->rate_start = ktime_get();
 	}
+	//A gated sensor keeps the array until its echo line falls
+	if(!dev->gated)
+	{
+		pulse_end_ping(dev);
+	}
+	wake_up_interruptible(&dev->read_wq);
+#ifdef PULSE_IIO
+	if(dev->iio_trig && !(flags & PULSE_SAMPLE_NO_ECHO))
+	{
+		iio_trigger_poll(dev->iio_trig);
+	}
+#endif
+}
 
-	/* Request I/O Region */
-	sprintf(pulse_dev->name, DRIVER_NAME);
-
-	/* Connect the file operations with the cdev */
-	cdev_init(&pulse_dev->cdev, &pulse_fops);
-	pulse_dev->cdev.owner = THIS_MODULE;
+/***********************************************************************
+* pulse_get_latest - This function is used to copy the last sample
+* 	without a lock.
+* 
+* @dev: Device Structure
+* @sample: Copy of the sample
+* 
+* Returns -
+* 
+* Description: Retries if the interrupt handler published a sample
+* 	meanwhile. seq is 0 before the first sample.
+***********************************************************************/
+static void pulse_get_latest(Pulse_Device *dev, struct pulse_sample *sample)
+{
+	unsigned int seq;
 
-	/* Connect the major/minor number to the cdev */
-	retValue = cdev_add(&pulse_dev->cdev, MKDEV(MAJOR(pulse_dev_number), PULSE_MINOR_NUMBER), 1);
-	if(retValue)
+	do
 	{
-		printk("Bad cdev for pulse_dev\n");
-		return retValue;
-	}
-	
-	/* A struct device will be created in sysfs, registered to the specified class.*/
-	device_create(pulse_class, NULL, MKDEV(MAJOR(pulse_dev_number), PULSE_MINOR_NUMBER), NULL, DEVICE_NAME);
-	
-	printk("Pulse Driver = %s Initialized.\n", DRIVER_NAME);
-	//printk("pulse.c pulse_init() Ends \n");
-	return 0;
+		seq = read_seqcount_begin(&dev->latest_seq);
+		*sample = dev->latest;
+	} while(read_seqcount_retry(&dev->latest_seq, seq));
 }
 
 /***********************************************************************
-* pulse_exit - This function is called when the driver is about to exit.
-* 	It is cleaning fuction to clean open function functionalities.
+* pulse_echo_timeout - This is the echo timer function.
 * 
-* Returns 0 on success
+* @timer: Echo timer of the device
 * 
-* Description: This function is called when the driver is about to exit.
-* 	It is cleaning fuction to clean open function functionalities.
+* Returns HRTIMER_RESTART to wait for the end of a gated echo, else
+* 	HRTIMER_NORESTART
+* 
+* Description: The timer is started with every trigger and expires
+* 	after the longest echo the sensor can send. If the measurement is
+* 	still in progress it is ended with a PULSE_SAMPLE_NO_ECHO sample so
+* 	that the next trigger is accepted. When a range gate is set, the
+* 	rising edge restarts the timer to expire after the echo time of the
+* 	maximum range, and a PULSE_SAMPLE_OUT_OF_RANGE sample is pushed
+* 	without waiting for the echo. The sensor ignores triggers, and its
+* 	burst may still reach the neighbours, until its echo line falls, so
+* 	it keeps the array until the falling edge or the echo timeout.
 ***********************************************************************/
-static void __exit pulse_exit(void)
+static enum hrtimer_restart pulse_echo_timeout(struct hrtimer *timer)
 {
-	//printk("pulse_exit() Start\n");
+	Pulse_Device *dev = container_of(timer, Pulse_Device, echo_timer);
+	enum hrtimer_restart restart = HRTIMER_NORESTART;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->lock, flags);
+	if(dev->BUSY_FLAG == 1 && dev->gated)
+	{
+		//The echo line never fell
+		pulse_end_ping(dev);
+	}
+	else if(dev->BUSY_FLAG == 1 && dev->timeRising != 0 && dev->gate_ns != 0)
+	{
+		dev->gated = 1;
+		pulse_push_sample(dev, PULSE_SAMPLE_NO_ECHO | PULSE_SAMPLE_OUT_OF_RANGE);
+		hrtimer_set_expires(timer, ns_to_ktime(dev->timeTrigger + PULSE_ECHO_TIMEOUT_MS * NSEC_PER_MSEC));
+		restart = HRTIMER_RESTART;
+	}
+	else if(dev->BUSY_FLAG == 1)
+	{
+		pulse_push_sample(dev, PULSE_SAMPLE_NO_ECHO);
+	}
+	spin_unlock_irqrestore(&dev->lock, flags);
+	return restart;
+}
+
+/***********************************************************************
+* change_state_interrupt - This is Interrrupt Handler function.
+* @irq: Interrupt line of the echo pin
+* @dev_id: Device Structure
+*
+* Returns IRQ_HANDLED
+* 
+* Description: This is Interrrupt Handler function. It checks for rising
+* 	and falling edges and notes down the time when rising edge arrived
+* 	and time when falling edge arrived. The line is requested for both
+* 	edges. The first edge after the trigger is the rising edge whatever
+* 	the level of the echo pin, which may already be low again when a
+* 	short echo is read late, and the next one is the falling edge. Once the
+* 	range gate has pushed its sample, the falling edge only frees the
+* 	array.
+***********************************************************************/
+static irqreturn_t change_state_interrupt(int irq, void *dev_id)
+{
+	Pulse_Device *dev = dev_id;
+	unsigned long long now = ktime_to_ns(ktime_get());
+	unsigned long long ticks = rdtsc();
+	unsigned long flags;
+	//printk("pulse.c change_state_interrupt Start\n");
+	spin_lock_irqsave(&dev->lock, flags);
+	if(dev->BUSY_FLAG == 1)
+	{
+		if(dev->gated)
+		{
+			//End of an echo the range gate already reported
+			hrtimer_try_to_cancel(&dev->echo_timer);
+			pulse_end_ping(dev);
+		}
+		else if(dev->timeRising == 0)
+		{
+			dev->timeRising = now;
+			dev->tickRising = ticks;
+			if(dev->gate_ns != 0)
+			{
+				hrtimer_start(&dev->echo_timer, ns_to_ktime(dev->gate_ns), HRTIMER_MODE_REL);
+			}
+		}
+		else
+		{
+			dev->timeFalling = now;
+			dev->tickFalling = ticks;
+			hrtimer_try_to_cancel(&dev->echo_timer);
+			pulse_push_sample(dev, 0);
+		}
+	}
+	spin_unlock_irqrestore(&dev->lock, flags);
+	//printk("pulse.c change_state_interrupt End\n");
+	return IRQ_HANDLED;
+}
+
+/***********************************************************************
+* pulse_trigger - This function is used to send the trigger pulse to the
+* 	sensor.
+* 
+* @dev: Device Structure
+* 
+* Returns 0 on success, -ERESTARTSYS on a signal
+* 
+* Description: Called from process context. It sleeps while another
+* 	sensor of the array is waiting for its echo, and until the guard
+* 	time after the previous measurement has elapsed. A trigger of a
+* 	sensor that is already measuring, or that another caller is about
+* 	to trigger, joins that measurement instead of pinging again.
+***********************************************************************/
+static int pulse_trigger(Pulse_Device *dev)
+{
+	unsigned long flags;
+	ktime_t ready;
+	int retValue;
+
+	spin_lock_irqsave(&pulse_array_lock, flags);
+	//A gated sensor has already reported its measurement, wait for its echo to end
+	if((pulse_active == dev && !dev->gated) || dev->trigger_pending)
+	{
+		spin_unlock_irqrestore(&pulse_array_lock, flags);
+		return 0;
+	}
+	dev->trigger_pending = 1;
+	spin_unlock_irqrestore(&pulse_array_lock, flags);
+
+	while(1)
+	{
+		spin_lock_irqsave(&pulse_array_lock, flags);
+		ready = pulse_array_ready;
+		if(ktime_to_ns(dev->ready_time) > ktime_to_ns(ready))
+		{
+			ready = dev->ready_time;
+		}
+		if(pulse_active == NULL && ktime_to_ns(ready) <= ktime_to_ns(ktime_get()))
+		{
+			pulse_active = dev;
+			dev->trigger_pending = 0;
+			spin_unlock_irqrestore(&pulse_array_lock, flags);
+			break;
+		}
+		spin_unlock_irqrestore(&pulse_array_lock, flags);
+		
+		if(ktime_to_ns(ready) > ktime_to_ns(ktime_get()))
+		{
+			set_current_state(TASK_INTERRUPTIBLE);
+			schedule_hrtimeout(&ready, HRTIMER_MODE_ABS);
+			__set_current_state(TASK_RUNNING);
+		}
+		//The guard time wait returns at once while a signal is pending
+		retValue = signal_pending(current) ? -ERESTARTSYS : wait_event_interruptible(pulse_array_wq, pulse_active == NULL);
+		if(retValue)
+		{
+			spin_lock_irqsave(&pulse_array_lock, flags);
+			dev->trigger_pending = 0;
+			spin_unlock_irqrestore(&pulse_array_lock, flags);
+			return retValue;
+		}
+	}
+	
+	spin_lock_irqsave(&dev->lock, flags);
+	dev->BUSY_FLAG = 1;
+	dev->timeTrigger = ktime_to_ns(ktime_get());
+	dev->timeRising = 0;
+	hrtimer_start(&dev->echo_timer, ktime_set(0, PULSE_ECHO_TIMEOUT_MS * NSEC_PER_MSEC), HRTIMER_MODE_REL);
+	spin_unlock_irqrestore(&dev->lock, flags);
+	
+	//Generate a trigger pulse
+	gpio_set_value_cansleep(dev->trigger_gpio, GPIO_VALUE_HIGH);
+	udelay(18);
+	gpio_set_value_cansleep(dev->trigger_gpio, GPIO_VALUE_LOW);
+	return 0;
+}
+
+/***********************************************************************
+* pulse_period_ms - This function is used to get the trigger period in
+* 	use.
+* 
+* @dev: Device Structure
+* 
+* Returns the period in ms
+***********************************************************************/
+static unsigned int pulse_period_ms(Pulse_Device *dev)
+{
+	if(dev->mode == PULSE_MODE_ADAPTIVE)
+	{
+		return ACCESS_ONCE(dev->adapt_period_ms);
+	}
+	return dev->period_ms;
+}
+
+/***********************************************************************
+* pulse_due - This function is used to get the time of the next trigger
+* 	of a free-running or adaptive sensor.
+* 
+* @dev: Device Structure
+* 
+* Returns the deadline
+* 
+* Description: A free-running sensor keeps absolute deadlines. The
+* 	deadline of an adaptive sensor follows its last trigger, so that a
+* 	shorter period takes effect at once.
+***********************************************************************/
+static ktime_t pulse_due(Pulse_Device *dev)
+{
+	if(dev->mode == PULSE_MODE_ADAPTIVE)
+	{
+		return ktime_add_ns(dev->last_trigger, (u64)pulse_period_ms(dev) * NSEC_PER_MSEC);
+	}
+	return dev->next_due;
+}
+
+/***********************************************************************
+* pulse_next_sensor - This function is used to pick the sensor in
+* 	free-running mode that is due first.
+* 
+* Returns the sensor, or NULL if no sensor is free-running
+* 
+* Description: Called with pulse_sched_lock held. Sensors still being
+* 	created at init are skipped.
+***********************************************************************/
+static Pulse_Device *pulse_next_sensor(void)
+{
+	Pulse_Device *next = NULL;
+	int i;
+
+	for(i = 0; i < pulse_sensors; i++)
+	{
+		if(pulse_devs[i] == NULL || pulse_devs[i]->mode == PULSE_MODE_SINGLE)
+		{
+			continue;
+		}
+		if(next == NULL || ktime_to_ns(pulse_due(pulse_devs[i])) < ktime_to_ns(pulse_due(next)))
+		{
+			next = pulse_devs[i];
+		}
+	}
+	return next;
+}
+
+/***********************************************************************
+* thread_pulse_scheduler - This is the kthread of the free-running mode.
+* 
+* @data: Not used
+* 
+* Returns 0
+* 
+* Description: This kthread triggers every sensor in free-running mode
+* 	every period_ms on absolute deadlines, and every sensor in adaptive
+* 	mode its adapted period after its last trigger, earliest deadline
+* 	first.
+* 	pulse_trigger() keeps the pings of the array apart, so a sensor is
+* 	triggered as soon as the previous echo has ended and the guard time
+* 	is over. A sensor that falls behind its deadlines is triggered as
+* 	soon as possible instead of catching up. pulse_sched_lock is only
+* 	held to pick the sensor and to advance its deadline, not while
+* 	pulse_trigger() waits for the array, so that pulse_set_mode() does
+* 	not wait for a ping.
+***********************************************************************/
+static int thread_pulse_scheduler(void *data)
+{
+	Pulse_Device *dev;
+	ktime_t due;
+	
+	while(!kthread_should_stop())
+	{
+		mutex_lock(&pulse_sched_lock);
+		dev = pulse_next_sensor();
+		if(dev == NULL)
+		{
+			set_current_state(TASK_INTERRUPTIBLE);
+			mutex_unlock(&pulse_sched_lock);
+			if(!kthread_should_stop())
+			{
+				schedule();
+			}
+			__set_current_state(TASK_RUNNING);
+			continue;
+		}
+		due = pulse_due(dev);
+		if(ktime_to_ns(due) > ktime_to_ns(ktime_get()))
+		{
+			//Sleep until due, or until the modes change
+			set_current_state(TASK_INTERRUPTIBLE);
+			mutex_unlock(&pulse_sched_lock);
+			if(!kthread_should_stop())
+			{
+				schedule_hrtimeout(&due, HRTIMER_MODE_ABS);
+			}
+			__set_current_state(TASK_RUNNING);
+			continue;
+		}
+		
+		mutex_unlock(&pulse_sched_lock);
+		
+		pulse_trigger(dev);
+		
+		mutex_lock(&pulse_sched_lock);
+		//The mode may have changed while the trigger waited
+		if(dev->mode == PULSE_MODE_SINGLE)
+		{
+			mutex_unlock(&pulse_sched_lock);
+			continue;
+		}
+		if(dev->mode == PULSE_MODE_ADAPTIVE)
+		{
+			dev->last_trigger = ktime_get();
+			mutex_unlock(&pulse_sched_lock);
+			continue;
+		}
+		dev->next_due = ktime_add_ns(dev->next_due, (u64)dev->period_ms * NSEC_PER_MSEC);
+		if(ktime_to_ns(dev->next_due) < ktime_to_ns(ktime_get()))
+		{
+			dev->next_due = ktime_get();
+		}
+		mutex_unlock(&pulse_sched_lock);
+	}
+	return 0;
+}
+
+/***********************************************************************
+* pulse_set_mode - This function is used to switch between single and
+* 	free-running measurements.
+* 
+* @dev: Device Structure
+* @mode: PULSE_MODE_SINGLE, PULSE_MODE_FREE_RUN or PULSE_MODE_ADAPTIVE
+* 
+* Returns 0 on success
+* 
+* Description: The adaptive mode starts at its shortest period.
+***********************************************************************/
+static int pulse_set_mode(Pulse_Device *dev, unsigned int mode)
+{
+	unsigned long flags;
+
+	if(mode != PULSE_MODE_FREE_RUN && mode != PULSE_MODE_SINGLE && mode != PULSE_MODE_ADAPTIVE)
+	{
+		return -EINVAL;
+	}
+	mutex_lock(&pulse_sched_lock);
+	if(mode == PULSE_MODE_FREE_RUN && dev->mode != mode)
+	{
+		dev->next_due = ktime_get();
+	}
+	if(mode == PULSE_MODE_ADAPTIVE && dev->mode != mode)
+	{
+		dev->last_trigger = ktime_set(0, 0);
+		spin_lock_irqsave(&dev->lock, flags);
+		dev->adapt_period_ms = dev->adaptive.min_period_ms;
+		dev->adapt_armed = 0;
+		spin_unlock_irqrestore(&dev->lock, flags);
+	}
+	dev->mode = mode;
+	mutex_unlock(&pulse_sched_lock);
+	wake_up_process(pulse_scheduler);
+	return 0;
+}
+
+/***********************************************************************
+* pulse_claim_hw - This function is used to set up the GPIO pins and
+* 	the interrupt of a sensor.
+* 
+* @pulse_dev: Device Structure
+* 
+* Returns 0 on success
+* 
+* Description: Called once when the sensor is created, so that opening
+* 	the device does not touch the hardware.
+***********************************************************************/
+static int pulse_claim_hw(Pulse_Device *pulse_dev)
+{
+	int irq_line;
+	int retValue;
+	
+	//IO2 and IO3 of the Galileo need their mux set to GPIO
+	if(pulse_dev->trigger_gpio == GP_IO2)
+	{
+		retValue = gpio_request_one(GP_IO2_MUX, GPIOF_OUT_INIT_LOW , "gpio31");
+		if(retValue)
+		{
+			goto fail_mux2;
+		}
+	}
+	if(pulse_dev->echo_gpio == GP_IO3)
+	{
+		retValue = gpio_request_one(GP_IO3_MUX, GPIOF_OUT_INIT_LOW , "gpio30");
+		if(retValue)
+		{
+			goto fail_mux3;
+		}
+	}
+	
+	//Set GPIO pins directions and values
+	retValue = gpio_request_one(pulse_dev->trigger_gpio, GPIOF_OUT_INIT_LOW , pulse_dev->name);
+	if(retValue)
+	{
+		goto fail_trigger;
+	}
+	retValue = gpio_request_one(pulse_dev->echo_gpio, GPIOF_IN , pulse_dev->name);
+	if(retValue)
+	{
+		goto fail_echo;
+	}
+	
+	/*install interrupt handler*/
+	irq_line = gpio_to_irq(pulse_dev->echo_gpio);
+	if(irq_line < 0)
+	{
+		printk("Gpio %d cannot be used as interrupt",pulse_dev->echo_gpio);
+		retValue = irq_line;
+		goto fail_irq;
+	}
+	pulse_dev->irq = irq_line;
+	
+	retValue = request_irq(irq_line, change_state_interrupt, IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING, pulse_dev->name, pulse_dev);
+	if(retValue)
+	{
+		printk("Unable to claim irq %d; error %d\n ", irq_line, retValue);
+		goto fail_irq;
+	}
+	return 0;
+
+fail_irq:
+	gpio_free(pulse_dev->echo_gpio);
+fail_echo:
+	gpio_free(pulse_dev->trigger_gpio);
+fail_trigger:
+	if(pulse_dev->echo_gpio == GP_IO3)
+	{
+		gpio_free(GP_IO3_MUX);
+	}
+fail_mux3:
+	if(pulse_dev->trigger_gpio == GP_IO2)
+	{
+		gpio_free(GP_IO2_MUX);
+	}
+fail_mux2:
+	printk("Unable to set up %s; error %d\n", pulse_dev->name, retValue);
+	return retValue;
+}
+
+/***********************************************************************
+* pulse_release_hw - This function is used to stop the measurements of
+* 	a sensor and give back its GPIO pins and interrupt.
+* 
+* @local_pulse_dev: Device Structure
+* 
+* Returns -
+* 
+* Description: Called when the sensor is destroyed, once no file is
+* 	open.
+***********************************************************************/
+static void pulse_release_hw(Pulse_Device *local_pulse_dev)
+{
+	unsigned long flags;
+
+	free_irq(local_pulse_dev->irq,local_pulse_dev);
+	hrtimer_cancel(&local_pulse_dev->echo_timer);
+	spin_lock_irqsave(&local_pulse_dev->lock, flags);
+	pulse_end_ping(local_pulse_dev);
+	spin_unlock_irqrestore(&local_pulse_dev->lock, flags);
+	
+	gpio_free(local_pulse_dev->trigger_gpio);
+	gpio_free(local_pulse_dev->echo_gpio);
+	if(local_pulse_dev->trigger_gpio == GP_IO2)
+	{
+		gpio_free(GP_IO2_MUX);
+	}
+	if(local_pulse_dev->echo_gpio == GP_IO3)
+	{
+		gpio_free(GP_IO3_MUX);
+	}
+}
+
+/***********************************************************************
+* pulse_iio_busy - This function is used to check if the IIO buffer of
+* 	a sensor is capturing.
+* 
+* @dev: Device Structure
+* 
+* Returns non zero while the buffer is enabled
+***********************************************************************/
+static int pulse_iio_busy(Pulse_Device *dev)
+{
+#ifdef PULSE_IIO
+	return dev->iio_started || (dev->iio && iio_buffer_enabled(dev->iio));
+#else
+	return 0;
+#endif
+}
+
+/***********************************************************************
+* pulse_fasync - This function is used to turn SIGIO on threshold
+* 	events on and off.
+* 
+* @fd: File Descriptor
+* @filp: File Pointer
+* @on: Non zero to add the owner of the file
+* 
+* Returns 0 on success
+***********************************************************************/
+static int pulse_fasync(int fd, struct file *filp, int on)
+{
+	Pulse_File *file = filp->private_data;
+
+	return fasync_helper(fd, filp, on, &file->fasync);
+}
+
+/***********************************************************************
+* pulse_open - This is function that will be called when the device is
+* 	opened.
+* @inode: Inode structure
+* @filp: File Pointer
+* 
+* Returns 0 on success
+* 
+* Description: This is function that will be called when the device is 
+* 	opened. The sensor can be opened by several processes at once and
+* 	every file gets its own read cursor, starting at the next sample.
+* 	The hardware is set up when the sensor is created, so opening it
+* 	only allocates the file context and does not disturb a measurement
+* 	in flight.
+***********************************************************************/
+int pulse_open(struct inode *inode, struct file *filp)
+{
+	Pulse_Device *pulse_dev;
+	Pulse_File *file;
+	unsigned long flags;
+	
+	//printk("pulse.c pulse_open() Start \n");
+	
+	/* Get the per-device structure that contains this cdev */
+	pulse_dev = container_of(inode->i_cdev, Pulse_Device, cdev);
+	
+	file = kzalloc(sizeof(Pulse_File), GFP_KERNEL);
+	if(!file)
+	{
+		return -ENOMEM;
+	}
+	file->dev = pulse_dev;
+	mutex_init(&file->read_lock);
+	INIT_LIST_HEAD(&file->node);
+	
+	/* Easy access to cmos_devp from rest of the entry points */
+	filp->private_data = file;
+	
+	mutex_lock(&pulse_open_lock);
+	pulse_dev->users++;
+	file->cursor = ACCESS_ONCE(pulse_dev->ring->head);
+	spin_lock_irqsave(&pulse_dev->lock, flags);
+	list_add_tail(&file->node, &pulse_dev->files);
+	spin_unlock_irqrestore(&pulse_dev->lock, flags);
+	mutex_unlock(&pulse_open_lock);
+	
+	//printk("%s has opened\n", pulse_dev->name);
+	//printk("pulse.c pulse_open() End \n");
+	return 0;
+}
+
+/***********************************************************************
+* pulse_release - This is is used by the driver to close anything which 
+* 	has been opened and used during driver execution.
+* 
+* @inode: Inode structure
+* @filp: File Pointer
+* 
+* Returns 0 on success
+* 
+* Description: This is is used by the driver to close anything which 
+* 	has been opened and used during driver execution. Closing the last
+* 	file of the sensor stops its free-running measurements, unless the
+* 	IIO buffer is capturing them.
+***********************************************************************/
+int pulse_release(struct inode *inode, struct file *filp)
+{
+	Pulse_File *file = filp->private_data;
+	Pulse_Device *local_pulse_dev;
+	unsigned long flags;
+	//printk("pulse.c pulse_release() Start\n");
+	
+	local_pulse_dev = file->dev;
+	pulse_fasync(-1, filp, 0);
+	mutex_lock(&pulse_open_lock);
+	spin_lock_irqsave(&local_pulse_dev->lock, flags);
+	list_del(&file->node);
+	spin_unlock_irqrestore(&local_pulse_dev->lock, flags);
+	if(--local_pulse_dev->users == 0 && !pulse_iio_busy(local_pulse_dev))
+	{
+		pulse_set_mode(local_pulse_dev, PULSE_MODE_SINGLE);
+	}
+	mutex_unlock(&pulse_open_lock);
+	
+	vfree(file->ctl);
+	kfree(file);
+	//printk("pulse_release -- %s is closing\n", local_pulse_dev->name);
+	//printk("pulse.c pulse_release() End\n");
+	return 0;
+}
+
+/***********************************************************************
+* pulse_write - This function is used to send the trigger pulse to the
+* 	sensor.
+* 
+* @filp: File Pointer
+* @buf: Buffer
+* @count: Size of Buffer
+* @ppos: Position Pointer
+* 
+* Returns 0 on success
+* 
+* Description: This function is used to send the trigger pulse to the
+* 	sensor. Triggers of several files are coalesced into one
+* 	measurement, and a free-running or adaptive sensor is not triggered
+* 	again since its next measurement is already scheduled.
+***********************************************************************/
+static ssize_t pulse_write(struct file *filp, const char *buf, size_t count, loff_t *ppos)
+{
+	Pulse_Device *dev = ((Pulse_File *)filp->private_data)->dev;
+	int retValue = 0;
+	//printk("pulse.c pulse_write() Start\n");
+	
+	if(dev->mode != PULSE_MODE_SINGLE)
+	{
+		return 0;
+	}
+	retValue = pulse_trigger(dev);
+	//printk("pulse.c pulse_write() End\n");
+	return retValue;
+}
+
+/***********************************************************************
+* pulse_wait - This function is used to sleep until the ring holds a
+* 	sample the file has not read yet.
+* 
+* @filp: File Pointer
+* 
+* Returns 0 once available, -EAGAIN for a non blocking file, -ETIMEDOUT
+* 	if no sample arrived in time, -ERESTARTSYS on a signal
+***********************************************************************/
+static int pulse_wait(struct file *filp)
+{
+	Pulse_File *file = filp->private_data;
+	Pulse_Device *dev = file->dev;
+	long timeout;
+
+	if(ACCESS_ONCE(dev->ring->head) != file->cursor)
+	{
+		return 0;
+	}
+	if(filp->f_flags & O_NONBLOCK)
+	{
+		return -EAGAIN;
+	}
+	timeout = msecs_to_jiffies(PULSE_READ_TIMEOUT_MS + pulse_period_ms(dev));
+	timeout = wait_event_interruptible_timeout(dev->read_wq,
+		ACCESS_ONCE(dev->ring->head) != file->cursor, timeout);
+	if(timeout < 0)
+	{
+		return timeout;
+	}
+	if(timeout == 0)
+	{
+		return -ETIMEDOUT;
+	}
+	return 0;
+}
+
+/***********************************************************************
+* pulse_read - This function is used by the user application to measure
+* 	the pulse width. That is it measures the distance of object from the
+* 	sensor.
+* 
+* @filp: File Pointer
+* @buf: Buffer
+* @count: Size of Buffer
+* @ptr: Position Pointer
+* 
+* Returns the number of bytes read
+* 
+* Description: This function is used by the user application to measure
+* 	the pulse width. That is it measures the distance of object from the
+* 	sensor. Every file has its own cursor in the sample ring, so all the
+* 	readers of a sensor get every sample. It returns as many samples the
+* 	file has not read as fit in the buffer, oldest first; a file that
+* 	fell more than PULSE_RING_SIZE samples behind skips to the oldest
+* 	one kept. The ring is read without a lock. While there is nothing
+* 	new the caller sleeps until the measurement ends, unless the file
+* 	was opened with O_NONBLOCK.
+***********************************************************************/
+static ssize_t pulse_read(struct file *filp, char *buf, size_t count, loff_t *ptr)
+{
+	Pulse_File *file = filp->private_data;
+	Pulse_Device *pulse_dev = file->dev;
+	struct pulse_sample sample;
+	int retValue=0;
+	size_t copied=0;
+	__u32 head;
+	//printk("pulse.c pulse_read() Start\n");
+	if(count < sizeof(struct pulse_sample))
+	{
+		return -EINVAL;
+	}
+	mutex_lock(&file->read_lock);
+	retValue = pulse_wait(filp);
+	if(retValue)
+	{
+		mutex_unlock(&file->read_lock);
+		return retValue;
+	}
+	while(copied + sizeof(sample) <= count)
+	{
+		head = ACCESS_ONCE(pulse_dev->ring->head);
+		smp_rmb();
+		if(file->cursor == head)
+		{
+			break;
+		}
+		if(head - file->cursor > PULSE_RING_SIZE)
+		{
+			file->cursor = head - PULSE_RING_SIZE;
+		}
+		if(pulse_ring_read(pulse_dev, file->cursor, &sample))
+		{
+			//Overwritten while read, skip it
+			file->cursor++;
+			continue;
+		}
+		if(copy_to_user(buf + copied, &sample, sizeof(sample)))
+		{
+			mutex_unlock(&file->read_lock);
+			return -EFAULT;
+		}
+		file->cursor++;
+		copied += sizeof(sample);
+	}
+	mutex_unlock(&file->read_lock);
+	if(copied == 0)
+	{
+		return -EAGAIN;
+	}
+	//printk("pulse.c pulse_read() End\n");
+	return copied;
+}
+
+/***********************************************************************
+* pulse_ioctl - This function is used to configure the measurements.
+* 
+* @filp: File Pointer
+* @cmd: Command
+* @arg: Input Arguments
+* 
+* Returns 0 on success
+***********************************************************************/
+static long pulse_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	Pulse_File *file = filp->private_data;
+	Pulse_Device *dev = file->dev;
+	struct pulse_filter filter;
+	struct pulse_sample sample;
+	struct pulse_threshold threshold;
+	struct pulse_event event;
+	struct pulse_adaptive adaptive;
+	unsigned long flags;
+	unsigned int i;
+	__u32 value;
+
+	if(cmd == PULSE_IOC_SET_FILTER)
+	{
+		if(copy_from_user(&filter, (void __user *)arg, sizeof(filter)))
+		{
+			return -EFAULT;
+		}
+		return pulse_set_filter(dev, &filter);
+	}
+	if(cmd == PULSE_IOC_GET_LATEST)
+	{
+		pulse_get_latest(dev, &sample);
+		if(sample.seq == 0)
+		{
+			return -ENODATA;
+		}
+		if(copy_to_user((void __user *)arg, &sample, sizeof(sample)))
+		{
+			return -EFAULT;
+		}
+		return 0;
+	}
+	if(cmd == PULSE_IOC_SET_THRESHOLD)
+	{
+		if(copy_from_user(&threshold, (void __user *)arg, sizeof(threshold)))
+		{
+			return -EFAULT;
+		}
+		if(threshold.edges > PULSE_THRESHOLD_EDGES)
+		{
+			return -EINVAL;
+		}
+		for(i = 1; i < threshold.edges; i++)
+		{
+			if(threshold.edge_mm[i] <= threshold.edge_mm[i - 1])
+			{
+				return -EINVAL;
+			}
+		}
+		spin_lock_irqsave(&dev->lock, flags);
+		file->threshold = threshold;
+		file->armed = 0;
+		file->event_pending = 0;
+		spin_unlock_irqrestore(&dev->lock, flags);
+		return 0;
+	}
+	if(cmd == PULSE_IOC_SET_ADAPTIVE)
+	{
+		if(copy_from_user(&adaptive, (void __user *)arg, sizeof(adaptive)))
+		{
+			return -EFAULT;
+		}
+		if(adaptive.min_period_ms < PULSE_MIN_PERIOD_MS || adaptive.max_period_ms < adaptive.min_period_ms || adaptive.max_period_ms > PULSE_MAX_PERIOD_MS)
+		{
+			return -EINVAL;
+		}
+		spin_lock_irqsave(&dev->lock, flags);
+		dev->adaptive = adaptive;
+		dev->adapt_period_ms = clamp(dev->adapt_period_ms, adaptive.min_period_ms, adaptive.max_period_ms);
+		spin_unlock_irqrestore(&dev->lock, flags);
+		wake_up_process(pulse_scheduler);
+		return 0;
+	}
+	if(cmd == PULSE_IOC_GET_EVENT)
+	{
+		spin_lock_irqsave(&dev->lock, flags);
+		event = file->event;
+		value = file->event_pending;
+		file->event_pending = 0;
+		spin_unlock_irqrestore(&dev->lock, flags);
+		if(!value)
+		{
+			return -ENODATA;
+		}
+		if(copy_to_user((void __user *)arg, &event, sizeof(event)))
+		{
+			return -EFAULT;
+		}
+		return 0;
+	}
+	if(get_user(value, (__u32 __user *)arg))
+	{
+		return -EFAULT;
+	}
+	switch(cmd)
+	{
+	case PULSE_IOC_SET_MODE:
+		return pulse_set_mode(dev, value);
+	case PULSE_IOC_SET_PERIOD:
+		if(value < PULSE_MIN_PERIOD_MS || value > PULSE_MAX_PERIOD_MS)
+		{
+			return -EINVAL;
+		}
+		dev->period_ms = value;
+		return 0;
+	case PULSE_IOC_SET_MAX_RANGE:
+		if(value > PULSE_MAX_RANGE_MM)
+		{
+			return -EINVAL;
+		}
+		dev->max_range_mm = value;
+		//Round trip time at 343 m/s
+		dev->gate_ns = div_u64((u64)value * 2000000, 343);
+		return 0;
+	case PULSE_IOC_SET_GUARD:
+		if(value > PULSE_MAX_GUARD_US)
+		{
+			return -EINVAL;
+		}
+		dev->guard_us = value;
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+/***********************************************************************
+* pulse_mmap - This function is used to map the sample ring, or the
+* 	control page of the file, into user space.
+* 
+* @filp: File Pointer
+* @vma: User Mapping
+* 
+* Returns 0 on success
+* 
+* Description: The ring is mapped read-only at offset 0. The control
+* 	page is mapped at PULSE_RING_CTL_OFFSET, it is allocated on the
+* 	first mapping and belongs to the file.
+***********************************************************************/
+static int pulse_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	Pulse_File *file = filp->private_data;
+	unsigned long size = vma->vm_end - vma->vm_start;
+
+	if(vma->vm_pgoff == 0)
+	{
+		if(size > PAGE_ALIGN(sizeof(struct pulse_ring)) || (vma->vm_flags & VM_WRITE))
+		{
+			return -EINVAL;
+		}
+		vma->vm_flags &= ~VM_MAYWRITE;
+		return remap_vmalloc_range(vma, file->dev->ring, 0);
+	}
+	if(vma->vm_pgoff == PULSE_RING_CTL_OFFSET >> PAGE_SHIFT && size <= PAGE_SIZE)
+	{
+		if(file->ctl == NULL)
+		{
+			file->ctl = vmalloc_user(PAGE_SIZE);
+			if(file->ctl == NULL)
+			{
+				return -ENOMEM;
+			}
+			file->ctl->tail = file->dev->ring->head;
+		}
+		return remap_vmalloc_range(vma, file->ctl, 0);
+	}
+	return -EINVAL;
+}
+
+/***********************************************************************
+* pulse_poll - This function is used to wait for samples with poll()
+* 	and select().
+* 
+* @filp: File Pointer
+* @wait: Poll Table
+* 
+* Returns the poll mask
+* 
+* Description: POLLIN is raised while the ring holds records past the
+* 	tail of the control page of the file, or if the file has no control
+* 	page, past the read() cursor of the file. POLLPRI is raised while
+* 	a threshold event of the file has not been fetched. POLLOUT is
+* 	always raised since a trigger can be written at any time.
+***********************************************************************/
+static unsigned int pulse_poll(struct file *filp, poll_table *wait)
+{
+	Pulse_File *file = filp->private_data;
+	Pulse_Device *dev = file->dev;
+	unsigned int mask = POLLOUT | POLLWRNORM;
+
+	poll_wait(filp, &dev->read_wq, wait);
+	if((file->ctl ? ACCESS_ONCE(file->ctl->tail) : file->cursor) != ACCESS_ONCE(dev->ring->head))
+	{
+		mask |= POLLIN | POLLRDNORM;
+	}
+	if(ACCESS_ONCE(file->event_pending))
+	{
+		mask |= POLLPRI;
+	}
+	return mask;
+}
+
+/***********************************************************************
+* raw_ticks_show / width_ns_show - sysfs attributes reporting the length
+* 	of the last echo in TSC ticks and in nanoseconds. Their ratio is the
+* 	TSC rate of the board.
+***********************************************************************/
+static ssize_t raw_ticks_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	Pulse_Device *pulse = dev_get_drvdata(dev);
+	return sprintf(buf, "%llu\n", pulse->raw_ticks);
+}
+
+static ssize_t width_ns_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	Pulse_Device *pulse = dev_get_drvdata(dev);
+	return sprintf(buf, "%llu\n", pulse->width_ns);
+}
+
+/***********************************************************************
+* samples_show / sample_rate_show - sysfs attributes reporting the
+* 	number of measurements of the sensor and the measurements completed
+* 	in the last second.
+***********************************************************************/
+static ssize_t samples_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	Pulse_Device *pulse = dev_get_drvdata(dev);
+	return sprintf(buf, "%lu\n", pulse->samples);
+}
+
+static ssize_t sample_rate_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	Pulse_Device *pulse = dev_get_drvdata(dev);
+	return sprintf(buf, "%u\n", pulse->rate);
+}
+
+/***********************************************************************
+* period_ms_show - sysfs attribute reporting the trigger period in use,
+* 	the adapted one in adaptive mode.
+***********************************************************************/
+static ssize_t period_ms_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	Pulse_Device *pulse = dev_get_drvdata(dev);
+	return sprintf(buf, "%u\n", pulse_period_ms(pulse));
+}
+
+static DEVICE_ATTR(raw_ticks, S_IRUGO, raw_ticks_show, NULL);
+static DEVICE_ATTR(width_ns, S_IRUGO, width_ns_show, NULL);
+static DEVICE_ATTR(samples, S_IRUGO, samples_show, NULL);
+static DEVICE_ATTR(sample_rate, S_IRUGO, sample_rate_show, NULL);
+static DEVICE_ATTR(period_ms, S_IRUGO, period_ms_show, NULL);
+
+/***********************************************************************
+* class_sample_rate_show - sysfs attribute of the class reporting the
+* 	measurements of all the sensors completed in the last second.
+***********************************************************************/
+static ssize_t class_sample_rate_show(struct class *class, struct class_attribute *attr, char *buf)
+{
+	unsigned int rate = 0;
+	int i;
+
+	for(i = 0; i < pulse_sensors; i++)
+	{
+		if(pulse_devs[i])
+		{
+			rate += pulse_devs[i]->rate;
+		}
+	}
+	return sprintf(buf, "%u\n", rate);
+}
+
+static struct class_attribute class_attr_sample_rate =
+	__ATTR(sample_rate, S_IRUGO, class_sample_rate_show, NULL);
+
+/**
+ * File operations structure. Defined in linux/fs.h
+ */
+static struct file_operations pulse_fops =
+{
+		.owner = THIS_MODULE,			/* Owner */
+		.open = pulse_open,             /* Open method */
+		.release = pulse_release,       /* Release method */
+		.write = pulse_write,           /* Write method */
+		.read = pulse_read,				/* Read method */
+		.unlocked_ioctl = pulse_ioctl,	/* Ioctl method */
+		.mmap = pulse_mmap,				/* Mmap method */
+		.poll = pulse_poll,				/* Poll method */
+		.fasync = pulse_fasync			/* Fasync method */
+};
+
+#ifdef PULSE_IIO
+/**
+ * IIO interface. Every sensor is also an IIO device with a distance
+ * channel, raw value in mm, and a soft timestamp. Its trigger fires on
+ * every sample with an echo, so the triggered buffer captures each
+ * sample once through the IIO kfifo.
+ */
+static const struct iio_chan_spec pulse_iio_channels[] =
+{
+	{
+		.type = IIO_DISTANCE,
+		.info_mask_separate = BIT(IIO_CHAN_INFO_RAW) | BIT(IIO_CHAN_INFO_SCALE),
+		.info_mask_shared_by_all = BIT(IIO_CHAN_INFO_SAMP_FREQ),
+		.scan_index = 0,
+		.scan_type =
+		{
+			.sign = 'u',
+			.realbits = 32,
+			.storagebits = 32,
+			.endianness = IIO_CPU,
+		},
+	},
+	IIO_CHAN_SOFT_TIMESTAMP(1),
+};
+
+/***********************************************************************
+* pulse_iio_measure - This function is used to get a distance for a
+* 	direct read of the IIO distance channel.
+* 
+* @dev: Device Structure
+* @mm: Filtered distance
+* 
+* Returns 0 on success, -EIO if there was no echo
+* 
+* Description: A sensor in single mode is triggered and the caller
+* 	sleeps until the measurement ends. Otherwise the last sample of the
+* 	running measurements is returned.
+***********************************************************************/
+static int pulse_iio_measure(Pulse_Device *dev, int *mm)
+{
+	struct pulse_sample sample;
+	__u32 seq;
+	long timeout;
+	int retValue;
+
+	pulse_get_latest(dev, &sample);
+	if(dev->mode == PULSE_MODE_SINGLE)
+	{
+		seq = sample.seq;
+		retValue = pulse_trigger(dev);
+		if(retValue)
+		{
+			return retValue;
+		}
+		timeout = wait_event_interruptible_timeout(dev->read_wq,
+			ACCESS_ONCE(dev->latest.seq) != seq, msecs_to_jiffies(PULSE_READ_TIMEOUT_MS));
+		if(timeout < 0)
+		{
+			return timeout;
+		}
+		if(timeout == 0)
+		{
+			return -ETIMEDOUT;
+		}
+		pulse_get_latest(dev, &sample);
+	}
+	if(sample.seq == 0 || (sample.flags & PULSE_SAMPLE_NO_ECHO))
+	{
+		return -EIO;
+	}
+	*mm = sample.filtered_mm;
+	return 0;
+}
+
+/***********************************************************************
+* pulse_iio_read_raw - This function is used to read the distance,
+* 	its scale and the sampling frequency through IIO.
+* 
+* @indio_dev: IIO Device
+* @chan: Channel
+* @val: Integer part
+* @val2: Micro part
+* @mask: IIO_CHAN_INFO_*
+* 
+* Returns the IIO_VAL_* type on success
+* 
+* Description: The scale converts mm to the metres of IIO. The sampling
+* 	frequency is the inverse of the trigger period in use.
+***********************************************************************/
+static int pulse_iio_read_raw(struct iio_dev *indio_dev, struct iio_chan_spec const *chan, int *val, int *val2, long mask)
+{
+	Pulse_Device *dev = *(Pulse_Device **)iio_priv(indio_dev);
+	unsigned int micro_hz;
+	int retValue;
+
+	switch(mask)
+	{
+	case IIO_CHAN_INFO_RAW:
+		retValue = iio_device_claim_direct_mode(indio_dev);
+		if(retValue)
+		{
+			return retValue;
+		}
+		retValue = pulse_iio_measure(dev, val);
+		iio_device_release_direct_mode(indio_dev);
+		if(retValue)
+		{
+			return retValue;
+		}
+		return IIO_VAL_INT;
+	case IIO_CHAN_INFO_SCALE:
+		*val = 0;
+		*val2 = 1000;
+		return IIO_VAL_INT_PLUS_MICRO;
+	case IIO_CHAN_INFO_SAMP_FREQ:
+		micro_hz = 1000000000U / pulse_period_ms(dev);
+		*val = micro_hz / 1000000;
+		*val2 = micro_hz % 1000000;
+		return IIO_VAL_INT_PLUS_MICRO;
+	default:
+		return -EINVAL;
+	}
+}
+
+/***********************************************************************
+* pulse_iio_write_raw - This function is used to set the sampling
+* 	frequency through IIO.
+* 
+* @indio_dev: IIO Device
+* @chan: Channel
+* @val: Integer part
+* @val2: Micro part
+* @mask: IIO_CHAN_INFO_*
+* 
+* Returns 0 on success
+* 
+* Description: The frequency sets the period of the free-running mode,
+* 	like PULSE_IOC_SET_PERIOD, rounded down to whole ms. It fails with
+* 	EBUSY in adaptive mode, where the period follows the scene.
+***********************************************************************/
+static int pulse_iio_write_raw(struct iio_dev *indio_dev, struct iio_chan_spec const *chan, int val, int val2, long mask)
+{
+	Pulse_Device *dev = *(Pulse_Device **)iio_priv(indio_dev);
+	u64 micro_hz;
+	u64 period_ms;
+
+	if(mask != IIO_CHAN_INFO_SAMP_FREQ)
+	{
+		return -EINVAL;
+	}
+	if(val < 0 || val2 < 0)
+	{
+		return -EINVAL;
+	}
+	if(dev->mode == PULSE_MODE_ADAPTIVE)
+	{
+		return -EBUSY;
+	}
+	micro_hz = (u64)val * 1000000 + val2;
+	if(micro_hz == 0)
+	{
+		return -EINVAL;
+	}
+	period_ms = div64_u64(1000000000ULL, micro_hz);
+	if(period_ms < PULSE_MIN_PERIOD_MS)
+	{
+		return -EINVAL;
+	}
+	dev->period_ms = period_ms > UINT_MAX ? UINT_MAX : period_ms;
+	return 0;
+}
+
+static const struct iio_info pulse_iio_info =
+{
+	.driver_module = THIS_MODULE,
+	.read_raw = pulse_iio_read_raw,
+	.write_raw = pulse_iio_write_raw,
+};
+
+/***********************************************************************
+* pulse_iio_trigger_handler - This is the threaded handler of the IIO
+* 	trigger.
+* 
+* @irq: IRQ of the poll function
+* @p: Poll Function
+* 
+* Returns IRQ_HANDLED
+* 
+* Description: It pushes the distance of the last sample and the time
+* 	stored by the top half into the IIO kfifo. The buffer may be driven
+* 	by another trigger, and the last sample may have been replaced by
+* 	one without an echo by the time the handler runs, so samples
+* 	without an echo and samples already pushed are skipped.
+***********************************************************************/
+static irqreturn_t pulse_iio_trigger_handler(int irq, void *p)
+{
+	struct iio_poll_func *pf = p;
+	struct iio_dev *indio_dev = pf->indio_dev;
+	Pulse_Device *dev = *(Pulse_Device **)iio_priv(indio_dev);
+	struct pulse_sample sample;
+	u32 data[4] __aligned(8);	/* Distance, padding and the s64 timestamp */
+
+	pulse_get_latest(dev, &sample);
+	if(sample.seq != dev->iio_seq && !(sample.flags & PULSE_SAMPLE_NO_ECHO))
+	{
+		dev->iio_seq = sample.seq;
+		memset(data, 0, sizeof(data));
+		data[0] = sample.filtered_mm;
+		iio_push_to_buffers_with_timestamp(indio_dev, data, pf->timestamp);
+	}
+	iio_trigger_notify_done(indio_dev->trig);
+	return IRQ_HANDLED;
+}
+
+/***********************************************************************
+* pulse_iio_postenable / pulse_iio_predisable - These functions are used
+* 	to start and stop the IIO buffer.
+* 
+* @indio_dev: IIO Device
+* 
+* Returns 0 on success
+* 
+* Description: A sensor in single mode is switched to free-running
+* 	mode while the buffer is enabled, so that it is sampled at the
+* 	IIO sampling frequency, and back to single mode afterwards.
+***********************************************************************/
+static int pulse_iio_postenable(struct iio_dev *indio_dev)
+{
+	Pulse_Device *dev = *(Pulse_Device **)iio_priv(indio_dev);
+	int retValue;
+
+	retValue = iio_triggered_buffer_postenable(indio_dev);
+	if(retValue)
+	{
+		return retValue;
+	}
+	if(dev->mode == PULSE_MODE_SINGLE)
+	{
+		dev->iio_started = 1;
+		pulse_set_mode(dev, PULSE_MODE_FREE_RUN);
+	}
+	return 0;
+}
+
+static int pulse_iio_predisable(struct iio_dev *indio_dev)
+{
+	Pulse_Device *dev = *(Pulse_Device **)iio_priv(indio_dev);
+
+	if(dev->iio_started)
+	{
+		dev->iio_started = 0;
+		pulse_set_mode(dev, PULSE_MODE_SINGLE);
+	}
+	return iio_triggered_buffer_predisable(indio_dev);
+}
+
+static const struct iio_buffer_setup_ops pulse_iio_buffer_ops =
+{
+	.postenable = pulse_iio_postenable,
+	.predisable = pulse_iio_predisable,
+};
+
+static const struct iio_trigger_ops pulse_iio_trigger_ops =
+{
+	.owner = THIS_MODULE,
+	.validate_device = iio_trigger_validate_own_device,
+};
+
+/***********************************************************************
+* pulse_iio_unregister - This function is used to remove the IIO device
+* 	and trigger of a sensor.
+* 
+* @dev: Device Structure
+* 
+* Returns -
+***********************************************************************/
+static void pulse_iio_unregister(Pulse_Device *dev)
+{
+	struct iio_trigger *trig = dev->iio_trig;
+	unsigned long flags;
+
+	if(dev->iio == NULL)
+	{
+		return;
+	}
+	iio_device_unregister(dev->iio);
+	//Stop the interrupt handler from firing the trigger
+	spin_lock_irqsave(&dev->lock, flags);
+	dev->iio_trig = NULL;
+	spin_unlock_irqrestore(&dev->lock, flags);
+	iio_trigger_unregister(trig);
+	iio_triggered_buffer_cleanup(dev->iio);
+	iio_device_free(dev->iio);
+	iio_trigger_free(trig);
+	dev->iio = NULL;
+}
+
+/***********************************************************************
+* pulse_iio_register - This function is used to create the IIO device
+* 	and trigger of a sensor.
+* 
+* @dev: Device Structure
+* @parent: sysfs device of the sensor
+* 
+* Returns 0 on success
+* 
+* Description: The trigger is named after the sensor, e.g.
+* 	"pulse0-sample", and is the default trigger of the device. It can
+* 	only drive the device of its own sensor.
+***********************************************************************/
+static int pulse_iio_register(Pulse_Device *dev, struct device *parent)
+{
+	struct iio_dev *indio_dev;
+	struct iio_trigger *trig;
+	int retValue;
+
+	indio_dev = iio_device_alloc(sizeof(Pulse_Device *));
+	if(!indio_dev)
+	{
+		return -ENOMEM;
+	}
+	*(Pulse_Device **)iio_priv(indio_dev) = dev;
+	indio_dev->dev.parent = parent;
+	indio_dev->name = dev->name;
+	indio_dev->info = &pulse_iio_info;
+	indio_dev->modes = INDIO_DIRECT_MODE;
+	indio_dev->channels = pulse_iio_channels;
+	indio_dev->num_channels = ARRAY_SIZE(pulse_iio_channels);
+
+	trig = iio_trigger_alloc("%s-sample", dev->name);
+	if(!trig)
+	{
+		retValue = -ENOMEM;
+		goto fail_trig;
+	}
+	trig->dev.parent = parent;
+	trig->ops = &pulse_iio_trigger_ops;
+	iio_trigger_set_drvdata(trig, indio_dev);
+	retValue = iio_trigger_register(trig);
+	if(retValue)
+	{
+		goto fail_trig_register;
+	}
+	indio_dev->trig = iio_trigger_get(trig);
+
+	retValue = iio_triggered_buffer_setup(indio_dev, iio_pollfunc_store_time, pulse_iio_trigger_handler, &pulse_iio_buffer_ops);
+	if(retValue)
+	{
+		goto fail_buffer;
+	}
+	retValue = iio_device_register(indio_dev);
+	if(retValue)
+	{
+		goto fail_register;
+	}
+	dev->iio = indio_dev;
+	spin_lock_irq(&dev->lock);
+	dev->iio_trig = trig;
+	spin_unlock_irq(&dev->lock);
+	return 0;
+
+fail_register:
+	iio_triggered_buffer_cleanup(indio_dev);
+fail_buffer:
+	iio_trigger_unregister(trig);
+fail_trig_register:
+	iio_trigger_free(trig);
+fail_trig:
+	iio_device_free(indio_dev);
+	return retValue;
+}
+#else
+static void pulse_iio_unregister(Pulse_Device *dev)
+{
+}
+
+static int pulse_iio_register(Pulse_Device *dev, struct device *parent)
+{
+	return 0;
+}
+#endif
+
+/***********************************************************************
+* pulse_destroy_sensors - This function is used to remove the device
+* 	nodes of the sensors and free them.
+* 
+* Returns -
+***********************************************************************/
+static void pulse_destroy_sensors(void)
+{
+	int i;
+
+	for(i = 0; i < PULSE_MAX_SENSORS; i++)
+	{
+		if(pulse_devs[i] == NULL)
+		{
+			continue;
+		}
+		pulse_iio_unregister(pulse_devs[i]);
+		device_destroy(pulse_class, MKDEV(MAJOR(pulse_dev_number), i));
+		cdev_del(&pulse_devs[i]->cdev);
+		pulse_release_hw(pulse_devs[i]);
+		vfree(pulse_devs[i]->ring);
+		kfree(pulse_devs[i]);
+		pulse_devs[i] = NULL;
+	}
+}
+
+/***********************************************************************
+* pulse_create_sensor - This function is used to set up one sensor and
+* 	its device node /dev/pulseN.
+* 
+* @index: Sensor number, also the minor number
+* 
+* Returns 0 on success
+***********************************************************************/
+static int pulse_create_sensor(int index)
+{
+	Pulse_Device *pulse_dev;
+	struct device *device;
+	int retValue;
+
+	/* Allocate memory for the per-device structure pulse_dev */
+	pulse_dev = kzalloc(sizeof(Pulse_Device), GFP_KERNEL);
+	if(!pulse_dev)
+	{
+		printk("Bad Kmalloc pulse_dev\n");
+		return -ENOMEM;
+	}
+
+	/* Request I/O Region */
+	sprintf(pulse_dev->name, DEVICE_NAME, index);
+	pulse_dev->index = index;
+	pulse_dev->trigger_gpio = trigger_gpios[index];
+	pulse_dev->echo_gpio = echo_gpios[index];
+	seqcount_init(&pulse_dev->latest_seq);
+	init_waitqueue_head(&pulse_dev->read_wq);
+	INIT_LIST_HEAD(&pulse_dev->files);
+	spin_lock_init(&pulse_dev->lock);
+	hrtimer_init(&pulse_dev->echo_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	pulse_dev->echo_timer.function = pulse_echo_timeout;
+	pulse_dev->filter.type = PULSE_FILTER_NONE;
+	pulse_dev->mode = PULSE_MODE_SINGLE;
+	pulse_dev->period_ms = PULSE_DEFAULT_PERIOD_MS;
+	pulse_dev->adaptive.min_period_ms = PULSE_DEFAULT_PERIOD_MS;
+	pulse_dev->adaptive.max_period_ms = PULSE_ADAPTIVE_MAX_PERIOD_MS;
+	pulse_dev->adaptive.hysteresis_mm = PULSE_ADAPTIVE_HYSTERESIS_MM;
+	pulse_dev->adapt_period_ms = PULSE_DEFAULT_PERIOD_MS;
+	pulse_dev->rate_start = ktime_get();
+	pulse_dev->ring = vmalloc_user(sizeof(struct pulse_ring));
+	if(!pulse_dev->ring)
+	{
+		kfree(pulse_dev);
+		return -ENOMEM;
+	}
+	pulse_dev->ring->size = PULSE_RING_SIZE;
+	pulse_dev->ring->record_size = sizeof(struct pulse_ring_record);
+	retValue = pulse_claim_hw(pulse_dev);
+	if(retValue)
+	{
+		vfree(pulse_dev->ring);
+		kfree(pulse_dev);
+		return retValue;
+	}
+
+	/* Connect the file operations with the cdev */
+	cdev_init(&pulse_dev->cdev, &pulse_fops);
+	pulse_dev->cdev.owner = THIS_MODULE;
+
+	/* Connect the major/minor number to the cdev */
+	retValue = cdev_add(&pulse_dev->cdev, MKDEV(MAJOR(pulse_dev_number), index), 1);
+	if(retValue)
+	{
+		printk("Bad cdev for pulse_dev\n");
+		pulse_release_hw(pulse_dev);
+		vfree(pulse_dev->ring);
+		kfree(pulse_dev);
+		return retValue;
+	}
+	pulse_devs[index] = pulse_dev;
+	
+	/* A struct device will be created in sysfs, registered to the specified class.*/
+	device = device_create(pulse_class, NULL, MKDEV(MAJOR(pulse_dev_number), index), pulse_dev, DEVICE_NAME, index);
+	if(IS_ERR(device))
+	{
+		return PTR_ERR(device);
+	}
+	device_create_file(device, &dev_attr_raw_ticks);
+	device_create_file(device, &dev_attr_width_ns);
+	device_create_file(device, &dev_attr_samples);
+	device_create_file(device, &dev_attr_sample_rate);
+	device_create_file(device, &dev_attr_period_ms);
+	
+	//The character device works without IIO
+	retValue = pulse_iio_register(pulse_dev, device);
+	if(retValue)
+	{
+		printk("%s: no IIO device; error %d\n", pulse_dev->name, retValue);
+	}
+	return 0;
+}
+
+/***********************************************************************
+* pulse_init - This function is called to initialize the Ultrasonic 
+* 	sensor.
+* 
+* Returns 0 on success
+* 
+* Description: This function is called to initialize the Ultrasonic 
+* 	sensor. One device is created per trigger/echo GPIO pair given as
+* 	module parameters.
+***********************************************************************/
+static int __init pulse_init(void)
+{
+	int retValue;
+	int i;
+	//printk("pulse.c pulse_init() Start \n");
+	
+	if(n_trigger_gpios != n_echo_gpios || n_trigger_gpios == 0)
+	{
+		printk("trigger_gpios and echo_gpios need as many GPIOs\n");
+		return -EINVAL;
+	}
+	pulse_sensors = n_trigger_gpios;
+	
+	/* Request dynamic allocation of a device major number */
+	if(alloc_chrdev_region(&pulse_dev_number, 0, pulse_sensors, DRIVER_NAME) < 0)
+	{
+		printk("Can't register device\n");
+		return -1;
+	}
+	
+	/* Populate sysfs entries */
+	pulse_class = class_create(THIS_MODULE, DRIVER_NAME);
+	class_create_file(pulse_class, &class_attr_sample_rate);
+	
+	/* The scheduler runs before any device node is there to wake it */
+	pulse_scheduler = kthread_run(&thread_pulse_scheduler, NULL, "kthread_pulse");
+	if(IS_ERR(pulse_scheduler))
+	{
+		retValue = PTR_ERR(pulse_scheduler);
+		goto fail_scheduler;
+	}
+	
+	for(i = 0; i < pulse_sensors; i++)
+	{
+		retValue = pulse_create_sensor(i);
+		if(retValue)
+		{
+			goto fail;
+		}
+	}
+	
+	printk("Pulse Driver = %s Initialized with %d sensors.\n", DRIVER_NAME, pulse_sensors);
+	//printk("pulse.c pulse_init() Ends \n");
+	return 0;
+
+fail:
+	kthread_stop(pulse_scheduler);
+	pulse_destroy_sensors();
+fail_scheduler:
+	class_remove_file(pulse_class, &class_attr_sample_rate);
+	class_destroy(pulse_class);
+	unregister_chrdev_region(pulse_dev_number, pulse_sensors);
+	return retValue;
+}
+
+/***********************************************************************
+* pulse_exit - This function is called when the driver is about to exit.
+* 	It is cleaning fuction to clean open function functionalities.
+* 
+* Returns 0 on success
+* 
+* Description: This function is called when the driver is about to exit.
+* 	It is cleaning fuction to clean open function functionalities.
+***********************************************************************/
+static void __exit pulse_exit(void)
+{
+	int i;
+	//printk("pulse_exit() Start\n");
+	
+	/* Disabling an IIO buffer may still need the scheduler */
+	for(i = 0; i < pulse_sensors; i++)
+	{
+		pulse_iio_unregister(pulse_devs[i]);
+	}
+	kthread_stop(pulse_scheduler);
 	
-	/* Destroy device with Minor Number 0*/
-	device_destroy(pulse_class, MKDEV(MAJOR(pulse_dev_number), PULSE_MINOR_NUMBER));
-	cdev_del(&pulse_dev->cdev);
-	kfree(pulse_dev);
+	/* Destroy the devices of all the sensors */
+	pulse_destroy_sensors();
 	
 	/* Destroy driver_class */
+	class_remove_file(pulse_class, &class_attr_sample_rate);
 	class_destroy(pulse_class);
 
 	/* Release the major number */
-	unregister_chrdev_region(pulse_dev_number, 1);
+	unregister_chrdev_region(pulse_dev_number, pulse_sensors);
 	printk("Pulse Driver = %s Uninitialized.\n", DRIVER_NAME);
 	//printk("pulse_exit() End\n");
 }
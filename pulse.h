@@ -0,0 +1,188 @@
+/***********************************************************************
+ *
+ * File Name: pulse.h
+ *
+ * Author: Ankit Rathi (ASU ID: 1207543476)
+ * 			(Ankit.Rathi@asu.edu)
+ *
+ * Date: 30-OCT-2014
+ *
+ * Description: Interface of the Ultrasonic Sensor Pulse driver shared
+ * 			by pulse.c and the user space programs.
+ *
+ **********************************************************************/
+
+#ifndef PULSE_H
+#define PULSE_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/**
+ * Measurement modes
+ */
+#define PULSE_MODE_SINGLE		0	/* One measurement per write() */
+#define PULSE_MODE_FREE_RUN		1	/* Driver re-triggers every period */
+#define PULSE_MODE_ADAPTIVE		2	/* Free-running, period follows the scene */
+
+#define PULSE_DEFAULT_PERIOD_MS	60	/* Sensor cycle time, about 16 Hz */
+#define PULSE_MIN_PERIOD_MS		10
+#define PULSE_MAX_PERIOD_MS		60000	/* One ping a minute */
+#define PULSE_MAX_RANGE_MM		4000	/* Longest range of the sensor */
+#define PULSE_MAX_GUARD_US		100000	/* Longest PULSE_IOC_SET_GUARD */
+
+/**
+ * Adaptive mode, set with PULSE_IOC_SET_ADAPTIVE. While the filtered
+ * distance moves by more than hysteresis_mm from one sample to the
+ * next, the sensor is triggered every min_period_ms. While it stays
+ * within hysteresis_mm the period doubles after every sample, up to
+ * max_period_ms. Samples without an echo leave the period unchanged.
+ * The period in use is reported in /sys/class/pulse/pulseN/period_ms.
+ */
+#define PULSE_ADAPTIVE_MAX_PERIOD_MS	1000	/* Default floor rate, 1 Hz */
+#define PULSE_ADAPTIVE_HYSTERESIS_MM	20
+
+struct pulse_adaptive {
+	__u32 min_period_ms;	/* Period while the scene moves, at least PULSE_MIN_PERIOD_MS */
+	__u32 max_period_ms;	/* Period of a still scene, min_period_ms to PULSE_MAX_PERIOD_MS */
+	__u32 hysteresis_mm;	/* Largest change of a still scene */
+};
+
+/**
+ * Flags of a sample
+ */
+#define PULSE_SAMPLE_NO_ECHO	0x1		/* No echo within the sensor's range, echo_ns is 0 */
+#define PULSE_SAMPLE_OUT_OF_RANGE	0x2	/* Echo longer than the PULSE_IOC_SET_MAX_RANGE gate */
+
+/**
+ * Filters, selected with PULSE_IOC_SET_FILTER. Samples carry both the raw
+ * and the filtered distance. Echoes that did not return are not filtered.
+ */
+#define PULSE_FILTER_NONE		0
+#define PULSE_FILTER_MEDIAN		1	/* Median of the last window distances */
+#define PULSE_FILTER_EMA		2	/* Exponential moving average */
+
+#define PULSE_MEDIAN_MAX		9	/* Largest median window */
+#define PULSE_FILTER_ALPHA_ONE	65536	/* EMA alpha of 1.0, alpha is Q16 */
+
+struct pulse_filter {
+	__u32 type;				/* PULSE_FILTER_* */
+	__u32 window;			/* Median window, 1 to PULSE_MEDIAN_MAX */
+	__u32 alpha;			/* Weight of a new distance, 1 to PULSE_FILTER_ALPHA_ONE */
+};
+
+/**
+ * One measurement. Every open file has its own read position, so
+ * several processes can read all the samples of one sensor. read()
+ * returns as many samples the file has not read yet as fit in the
+ * buffer, oldest first, and the number of bytes returned. The buffer
+ * must hold at least one sample. PULSE_IOC_GET_LATEST returns the last
+ * sample without touching the read position. A write() while the sensor
+ * is measuring, or about to, joins that measurement. seq numbers the
+ * samples of a sensor from 1, so a consumer can tell a new sample from
+ * one it has seen. Distances are computed for 343 m/s.
+ */
+#define PULSE_SAMPLE_VERSION	1
+
+struct pulse_sample {
+	__u16 version;			/* PULSE_SAMPLE_VERSION */
+	__u16 size;				/* sizeof(struct pulse_sample) */
+	__u32 seq;				/* Sample number */
+	__u64 timestamp_ns;		/* CLOCK_MONOTONIC time of the falling edge */
+	__u32 echo_ns;			/* Raw echo pulse width */
+	__u32 distance_mm;		/* Distance of the raw echo */
+	__u32 filtered_mm;		/* Distance after the filter */
+	__u32 flags;			/* PULSE_SAMPLE_* */
+};
+
+/**
+ * Sample ring. The driver keeps the last PULSE_RING_SIZE samples of a
+ * sensor in a ring that can be mapped read-only with mmap() at offset 0.
+ * The driver is the only writer. head is the position of the next
+ * record to be written; it only grows (modulo 2^32) and record N is
+ * records[N % size]. Every record carries its position plus one in
+ * seq, which is 0 while the record is being written.
+ *
+ * A consumer keeps its own tail position and reads records while tail
+ * differs from head. It reads seq, then the sample, then seq again. The
+ * record is valid if both reads of seq equal tail + 1. Otherwise the
+ * driver has lapped the consumer, which then restarts at head - size.
+ *
+ * To sleep in poll() once the ring is empty, a consumer maps its control
+ * page at offset PULSE_RING_CTL_OFFSET and keeps tail up to date in it.
+ * poll() then raises POLLIN while head differs from tail.
+ */
+#define PULSE_RING_SIZE			256		/* Records, a power of 2 */
+#define PULSE_RING_CTL_OFFSET	0x100000	/* mmap() offset of the control page */
+
+struct pulse_ring_record {
+	__u32 seq;				/* Position + 1, 0 while written */
+	__u32 reserved;
+	struct pulse_sample sample;
+};
+
+struct pulse_ring {
+	__u32 size;				/* PULSE_RING_SIZE */
+	__u32 head;				/* Position of the next record */
+	__u32 record_size;		/* sizeof(struct pulse_ring_record) */
+	__u32 reserved;
+	struct pulse_ring_record records[PULSE_RING_SIZE];
+};
+
+struct pulse_ring_ctl {
+	__u32 tail;				/* Position of the next record the consumer reads */
+};
+
+/**
+ * Threshold events. A file can ask to be told when the filtered distance
+ * moves from one band to another or changes by delta_mm since the last
+ * event. The edges, in ascending order, split the range into edges + 1
+ * bands; band N holds the distances with N edges at or below them. The
+ * first sample after PULSE_IOC_SET_THRESHOLD only sets the starting band
+ * and samples flagged PULSE_SAMPLE_NO_ECHO are ignored. On an event the
+ * driver raises POLLPRI and sends SIGIO to the owner of a file in
+ * FASYNC mode. PULSE_IOC_GET_EVENT returns the last event and clears it.
+ */
+#define PULSE_THRESHOLD_EDGES	8		/* Most band edges per file */
+
+#define PULSE_EVENT_BAND		0x1		/* The distance entered another band */
+#define PULSE_EVENT_DELTA		0x2		/* The distance changed by delta_mm */
+
+struct pulse_threshold {
+	__u32 edges;			/* Band edges used, 0 to PULSE_THRESHOLD_EDGES */
+	__u32 edge_mm[PULSE_THRESHOLD_EDGES];	/* Band edges, ascending */
+	__u32 delta_mm;			/* Smallest change reported, 0 to disable */
+};
+
+struct pulse_event {
+	__u32 seq;				/* Sample that raised the event */
+	__u32 reason;			/* PULSE_EVENT_* */
+	__u32 band;				/* Band of the sample */
+	__u32 prev_band;		/* Band before the event */
+	__u32 filtered_mm;		/* Filtered distance of the sample */
+	__u32 count;			/* Events since the last PULSE_IOC_GET_EVENT */
+	__u64 timestamp_ns;		/* Timestamp of the sample */
+};
+
+#define PULSE_IOC_MAGIC		'p'
+
+/* Select PULSE_MODE_SINGLE, PULSE_MODE_FREE_RUN or PULSE_MODE_ADAPTIVE */
+#define PULSE_IOC_SET_MODE		_IOW(PULSE_IOC_MAGIC, 0, __u32)
+/* Trigger period of PULSE_MODE_FREE_RUN in milliseconds, PULSE_MIN_PERIOD_MS to PULSE_MAX_PERIOD_MS */
+#define PULSE_IOC_SET_PERIOD	_IOW(PULSE_IOC_MAGIC, 1, __u32)
+/* Maximum range in mm, longer echoes end the measurement at once. 0 disables the gate */
+#define PULSE_IOC_SET_MAX_RANGE	_IOW(PULSE_IOC_MAGIC, 2, __u32)
+/* Minimum time in microseconds between the end of a measurement and the next trigger, up to PULSE_MAX_GUARD_US */
+#define PULSE_IOC_SET_GUARD		_IOW(PULSE_IOC_MAGIC, 3, __u32)
+/* Select the filter */
+#define PULSE_IOC_SET_FILTER	_IOW(PULSE_IOC_MAGIC, 4, struct pulse_filter)
+/* Copy the last sample, fails with ENODATA before the first one */
+#define PULSE_IOC_GET_LATEST	_IOR(PULSE_IOC_MAGIC, 5, struct pulse_sample)
+/* Set the band edges and delta of the file, no edges and no delta disable the events */
+#define PULSE_IOC_SET_THRESHOLD	_IOW(PULSE_IOC_MAGIC, 6, struct pulse_threshold)
+/* Copy and clear the pending event, fails with ENODATA if there is none */
+#define PULSE_IOC_GET_EVENT		_IOR(PULSE_IOC_MAGIC, 7, struct pulse_event)
+/* Periods and hysteresis of PULSE_MODE_ADAPTIVE */
+#define PULSE_IOC_SET_ADAPTIVE	_IOW(PULSE_IOC_MAGIC, 8, struct pulse_adaptive)
+
+#endif /* PULSE_H */
@@ -25,75 +25,516 @@
 #include <linux/uaccess.h>
 #include <linux/gpio.h>
 #include <linux/kthread.h>
+#include <linux/slab.h>
+#include <linux/jiffies.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/sort.h>
+#include <linux/poll.h>
+#include <linux/list.h>
+#include <linux/device.h>
+#include "spi_led.h"
 
 /**
  * Define constants using the macro
  */
 #define DRIVER_NAME 		"spidev"
-#define DEVICE_NAME 		"spidev"
+#define DEVICE_NAME 		"spidev%d.%d"	/* One node per bus and chip select */
 #define DEVICE_CLASS_NAME 	"spidev"
-#define MINOR_NUMBER    0
-#define MAJOR_NUMBER    154     /* assigned */
+#define N_SPI_MINORS	32		/* Displays handled by the driver */
 
 #define GPIO42 42
 #define GPIO43 43
 #define GPIO54 54
 #define GPIO55 55
 
-static DEFINE_MUTEX(device_list_lock);
+#define SPI_LED_SPEED_HZ	500000
+#define SPI_LED_BPW			8
+#define SPI_LED_SEQUENCE_LEN	10	/* (pattern, time) entries per sequence */
+#define SPI_LED_TIMER_SLACK_NS	10000	/* Allowed hrtimer slack per frame */
+#define SPI_LED_JITTER_SAMPLES	256		/* Frames kept for the p99 jitter */
+#define SPI_LED_MAX_MODULES		32		/* Longest supported MAX7219 chain */
+
+static DECLARE_BITMAP(minors, N_SPI_MINORS);
+static LIST_HEAD(device_list);
+static DEFINE_MUTEX(device_list_lock);	/* Protects device_list, minors and users */
+
+/**
+ * Allocation state of one pattern handle. The rows of the pattern are
+ * kept in pattern_rows and only turned into SPI transfers when the
+ * pattern is shown.
+ */
+struct spi_led_pattern {
+	unsigned int used;				/* Handle allocated */
+	struct file *owner;				/* File that allocated it, freed on close */
+};
+
+/**
+ * One sequence submission, terminated by a (0,0) entry
+ */
+struct spi_led_sequence {
+	unsigned int entry[SPI_LED_SEQUENCE_LEN][2];
+};
 
 /**
  * per device structure
  */
 struct spidev_data {
 	dev_t                   devt;
-	struct spi_device       *spi;
-	char pattern_buffer[10][8];
-	unsigned int sequence_buffer[10][2];
+	struct spi_device       *spi;	/* NULL once the device is removed, under buf_lock */
+	struct list_head        device_entry;
+	unsigned int            users;	/* Open files */
+	struct mutex open_lock;			/* Serialises the first open and the last close */
+	unsigned int opens;				/* Open files sharing the display, under open_lock */
+	struct mutex buf_lock;			/* Serialises access to the SPI buffers */
+	char *pattern_bank;				/* Pattern rows, mmap()-able by user space */
+	unsigned long bank_size;
+	unsigned int sequence_buffer[SPI_LED_SEQUENCE_LEN][2];	/* Sequence being played */
+	char *pattern_rows;				/* Committed rows, pattern_size per handle */
+	struct spi_led_pattern *patterns;	/* pattern_pool handles */
+	unsigned int patterns_used;
+	unsigned int modules;			/* MAX7219 modules daisy-chained on this chip select */
+	unsigned int pattern_size;		/* Bytes per pattern, SPI_LED_ROWS per module */
+	unsigned int row_len;			/* Bytes per row transfer, 2 per module */
+	unsigned char shadow[SPI_LED_ROWS * 2 * SPI_LED_MAX_MODULES];	/* Rows latched in the chain */
+	unsigned int shadow_valid;		/* 0 when the display content is unknown */
+	unsigned long rows_skipped;		/* Rows not sent because they were unchanged */
+	struct task_struct *task;		/* Playback kthread */
+	wait_queue_head_t wq;			/* Playback kthread sleeps here */
+	struct mutex play_lock;			/* Held while a sequence is playing */
+	struct spi_led_sequence *queue;	/* Submitted sequences, queue_depth entries */
+	unsigned int q_head;
+	unsigned int q_tail;
+	unsigned int q_count;
+	spinlock_t q_lock;				/* Protects the queue indices */
+	wait_queue_head_t space_wq;		/* Writers wait here for a free slot */
+	unsigned long sequences_done;	/* Sequences played to the end or aborted */
+	wait_queue_head_t done_wq;		/* Readers wait here for a finished sequence */
+	unsigned int abort;				/* Cut the current sequence short */
+	ktime_t deadline;				/* Scheduled time of the next frame */
+	spinlock_t stats_lock;			/* Protects the jitter statistics */
+	s64 jitter_min;					/* Presentation minus schedule, in ns */
+	s64 jitter_max;
+	u32 jitter[SPI_LED_JITTER_SAMPLES];	/* Ring of the latest frame jitters */
+	unsigned int jitter_count;		/* Frames recorded, saturates at the ring size */
+	unsigned int jitter_next;
+	struct spi_message cmd_msg;		/* Single register write */
+	struct spi_transfer cmd_xfer;
+	unsigned char *cmd_tx;
+	struct spi_message frame_msg;	/* Changed rows of the frame being shown */
+	struct spi_transfer frame_xfer[SPI_LED_ROWS];
+	unsigned char *frame_tx;		/* SPI_LED_ROWS * row_len bytes, DMA-safe */
+	unsigned long frames;			/* Frames pushed to the display */
+	unsigned long fps;				/* Frames counted in the last second */
+	unsigned long fps_frames;
+	unsigned long fps_start;		/* Start of the fps window in jiffies */
+};
+
+/**
+ * per open file structure
+ */
+struct spi_led_file {
+	struct spidev_data *spidev;
+	unsigned long done_seen;		/* sequences_done at the last read() */
 };
 
 /**
  * Global variables
  */
-static struct spidev_data *spidev_global;
 static struct class *spi_led_class;   	/* Device class */
-static unsigned bufsiz = 4096;
-static unsigned int busyFlag=0;
-static struct spi_message m;
-static unsigned char ch_tx[2]={0};
-static unsigned char ch_rx[2]={0};
-static struct spi_transfer t = {
-			.tx_buf = &ch_tx[0],
-			.rx_buf = &ch_rx[0],
-			.len = 2,
-			.cs_change = 1,
-			.bits_per_word = 8,
-			.speed_hz = 500000,
-			 };
+static int spi_led_major;			/* Allotted major number */
+
+static unsigned int queue_depth = 8;
+module_param(queue_depth, uint, S_IRUGO);
+MODULE_PARM_DESC(queue_depth, "Number of sequences that can be queued for playback");
+
+static unsigned int pattern_pool = 1024;
+module_param(pattern_pool, uint, S_IRUGO);
+MODULE_PARM_DESC(pattern_pool, "Number of pattern handles per display");
+
+static unsigned int modules = 1;
+module_param(modules, uint, S_IRUGO);
+MODULE_PARM_DESC(modules, "Number of daisy-chained MAX7219 modules per display");
 
 /***********************************************************************
 * spi_led_transfer - This function is used to transfer data to the spi
 * 	bus.
 * 
+* @spidev: Device Structure
 * @ch1: Address
 * @ch2: Data
 *
 * Returns: -
 * 
 * Description: This function is used to transfer data to the spi
-* 	bus.
+* 	bus. The register write goes to every module of the chain. Nothing
+* 	is sent once the device is removed.
 ***********************************************************************/
-static void spi_led_transfer(unsigned char ch1, unsigned char ch2)
+static void spi_led_transfer(struct spidev_data *spidev, unsigned char ch1, unsigned char ch2)
 {
     int ret=0;
-    ch_tx[0] = ch1;
-    ch_tx[1] = ch2;
-	spi_message_init(&m);
-	spi_message_add_tail(&t, &m);
-	ret = spi_sync(spidev_global->spi, &m);
+    unsigned int i=0;
+	mutex_lock(&spidev->buf_lock);
+	for(i=0;i<spidev->modules;i++)
+	{
+		spidev->cmd_tx[2*i] = ch1;
+		spidev->cmd_tx[2*i + 1] = ch2;
+	}
+	if(spidev->spi != NULL)
+	{
+		ret = spi_sync(spidev->spi, &spidev->cmd_msg);
+	}
+	mutex_unlock(&spidev->buf_lock);
 	return;
 }
 
+/***********************************************************************
+* spi_led_compile_rows - This function is used to load the rows of a
+* 	pattern into the frame message of the device.
+* 
+* @spidev: Device Structure
+* @rows: pattern_size bytes of row data, NULL for all rows off
+*
+* Returns: -
+* 
+* Description: This function copies the rows into the frame tx buffer.
+* 	The rows of module m are rows[m * SPI_LED_ROWS] onwards, module 0
+* 	being the one wired to the SPI bus. Data shifted out first ends up
+* 	in the last module, so each row transfer lists the modules from last
+* 	to first. Caller holds buf_lock.
+***********************************************************************/
+static void spi_led_compile_rows(struct spidev_data *spidev, const char *rows)
+{
+	unsigned int i=0, k=0, module=0;
+	unsigned char *tx;
+
+	for(i=0;i<SPI_LED_ROWS;i++)
+	{
+		tx = spidev->frame_tx + i * spidev->row_len;
+		for(k=0;k<spidev->modules;k++)
+		{
+			module = spidev->modules - 1 - k;
+			tx[2*k] = i + 1;
+			tx[2*k + 1] = rows ? rows[module * SPI_LED_ROWS + i] : 0;
+		}
+	}
+}
+
+/***********************************************************************
+* spi_led_commit_pattern - This function is used to take the rows of a
+* 	pattern from the pattern bank.
+* 
+* @spidev: Device Structure
+* @handle: Pattern Handle
+*
+* Returns: -
+* 
+* Description: The pattern bank is mapped by user space and may change
+* 	at any time, so the rows shown are a copy taken when the pattern is
+* 	loaded or committed. Caller holds buf_lock.
+***********************************************************************/
+static void spi_led_commit_pattern(struct spidev_data *spidev, unsigned int handle)
+{
+	memcpy(spidev->pattern_rows + handle * spidev->pattern_size,
+		spidev->pattern_bank + handle * spidev->pattern_size, spidev->pattern_size);
+}
+
+/***********************************************************************
+* spi_led_new_handle - This function is used to allocate a pattern
+* 	handle from the pool of the device.
+* 
+* @spidev: Device Structure
+* @handle: Handle to allocate, or pattern_pool for any free handle
+*
+* Returns: The handle on success, negative errno on failure
+* 
+* Description: The rows of the new pattern are cleared. Caller holds
+* 	buf_lock.
+***********************************************************************/
+static int spi_led_new_handle(struct spidev_data *spidev, unsigned int handle)
+{
+	if(handle == pattern_pool)
+	{
+		for(handle=0;handle<pattern_pool;handle++)
+		{
+			if(!spidev->patterns[handle].used)
+			{
+				break;
+			}
+		}
+		if(handle == pattern_pool)
+		{
+			return -ENOSPC;
+		}
+	}
+	spidev->patterns[handle].used = 1;
+	spidev->patterns[handle].owner = NULL;
+	spidev->patterns_used++;
+	memset(spidev->pattern_bank + handle * spidev->pattern_size, 0, spidev->pattern_size);
+	spi_led_commit_pattern(spidev, handle);
+	return handle;
+}
+
+/***********************************************************************
+* spi_led_build_messages - This function is used to allocate and chain
+* 	the SPI messages used by the driver.
+* 
+* @spidev: Device Structure
+*
+* Returns: 0 on success
+* 
+* Description: This function allocates DMA-safe tx buffers and sets up
+* 	the row transfers of the frame message, shared by all the patterns,
+* 	and a single transfer message for register writes. It also allocates
+* 	the SPI_LED_PATTERNS patterns loaded by SPI_LED_IOC_SET_PATTERNS.
+* 	Further patterns are allocated through ioctl.
+***********************************************************************/
+static int spi_led_build_messages(struct spidev_data *spidev)
+{
+	int i=0, retValue=0;
+	struct spi_transfer *xfer;
+
+	spidev->frame_tx = kzalloc(SPI_LED_ROWS * spidev->row_len, GFP_KERNEL);
+	spidev->cmd_tx = kzalloc(spidev->row_len, GFP_KERNEL);
+	if(!spidev->frame_tx || !spidev->cmd_tx)
+	{
+		return -ENOMEM;
+	}
+	for(i=0;i<SPI_LED_ROWS;i++)
+	{
+		xfer = &spidev->frame_xfer[i];
+		xfer->tx_buf = spidev->frame_tx + i * spidev->row_len;
+		xfer->len = spidev->row_len;
+		xfer->bits_per_word = SPI_LED_BPW;
+		xfer->speed_hz = SPI_LED_SPEED_HZ;
+	}
+
+	for(i=0;i<SPI_LED_PATTERNS;i++)
+	{
+		retValue = spi_led_new_handle(spidev, i);
+		if(retValue < 0)
+		{
+			return retValue;
+		}
+	}
+
+	spidev->cmd_xfer.tx_buf = spidev->cmd_tx;
+	spidev->cmd_xfer.len = spidev->row_len;
+	spidev->cmd_xfer.bits_per_word = SPI_LED_BPW;
+	spidev->cmd_xfer.speed_hz = SPI_LED_SPEED_HZ;
+	spi_message_init(&spidev->cmd_msg);
+	spi_message_add_tail(&spidev->cmd_xfer, &spidev->cmd_msg);
+	return 0;
+}
+
+/***********************************************************************
+* spi_led_free_data - This function is used to free the per device
+* 	structure and the buffers it owns.
+* 
+* @spidev: Device Structure
+*
+* Returns: -
+***********************************************************************/
+static void spi_led_free_data(struct spidev_data *spidev)
+{
+	kfree(spidev->patterns);
+	vfree(spidev->pattern_rows);
+	kfree(spidev->frame_tx);
+	kfree(spidev->cmd_tx);
+	kfree(spidev->queue);
+	vfree(spidev->pattern_bank);
+	kfree(spidev);
+}
+
+/***********************************************************************
+* spi_led_update - This function is used to bring the LED Display in
+* 	line with a pattern.
+* 
+* @spidev: Device Structure
+* @rows: pattern_size bytes of row data, NULL for all rows off
+*
+* Returns: 0 on success
+* 
+* Description: This function builds the rows into the frame message,
+* 	compares them with the shadow copy of the display and links only
+* 	the changed rows, chained with chip select toggling in between, so
+* 	that the frame goes out with one spi_sync(). Caller holds buf_lock.
+* 	Fails with -ESHUTDOWN once the device is removed.
+***********************************************************************/
+static int __spi_led_update(struct spidev_data *spidev, const char *rows)
+{
+	int i=0, retValue=0;
+	unsigned int offset=0;
+	struct spi_transfer *last = NULL;
+
+	if(spidev->spi == NULL)
+	{
+		return -ESHUTDOWN;
+	}
+	spi_led_compile_rows(spidev, rows);
+	spi_message_init(&spidev->frame_msg);
+	for(i=0;i<SPI_LED_ROWS;i++)
+	{
+		offset = i * spidev->row_len;
+		if(spidev->shadow_valid && memcmp(spidev->shadow + offset, spidev->frame_tx + offset, spidev->row_len) == 0)
+		{
+			spidev->rows_skipped++;
+			continue;
+		}
+		/* Latch each row, the last one is released by the controller */
+		spidev->frame_xfer[i].cs_change = 1;
+		spi_message_add_tail(&spidev->frame_xfer[i], &spidev->frame_msg);
+		last = &spidev->frame_xfer[i];
+	}
+	if(last != NULL)
+	{
+		last->cs_change = 0;
+		retValue = spi_sync(spidev->spi, &spidev->frame_msg);
+		if(retValue == 0)
+		{
+			memcpy(spidev->shadow, spidev->frame_tx, SPI_LED_ROWS * spidev->row_len);
+			spidev->shadow_valid = 1;
+		}
+		else
+		{
+			spidev->shadow_valid = 0;
+		}
+	}
+	return retValue;
+}
+
+static int spi_led_update(struct spidev_data *spidev, const char *rows)
+{
+	int retValue=0;
+
+	mutex_lock(&spidev->buf_lock);
+	retValue = __spi_led_update(spidev, rows);
+	mutex_unlock(&spidev->buf_lock);
+	return retValue;
+}
+
+/***********************************************************************
+* spi_led_show_pattern - This function is used to push a whole pattern
+* 	to the LED Display.
+* 
+* @spidev: Device Structure
+* @handle: Pattern Handle
+*
+* Returns: 0 on success, -ENOENT if the handle is not allocated
+* 
+* Description: This function updates the display with the pattern and
+* 	updates the frame counters.
+***********************************************************************/
+static int spi_led_show_pattern(struct spidev_data *spidev, unsigned int handle)
+{
+	int retValue=0;
+
+	mutex_lock(&spidev->buf_lock);
+	if(handle >= pattern_pool || !spidev->patterns[handle].used)
+	{
+		mutex_unlock(&spidev->buf_lock);
+		return -ENOENT;
+	}
+	retValue = __spi_led_update(spidev, spidev->pattern_rows + handle * spidev->pattern_size);
+	mutex_unlock(&spidev->buf_lock);
+
+	spidev->frames++;
+	spidev->fps_frames++;
+	if(time_after_eq(jiffies, spidev->fps_start + HZ))
+	{
+		spidev->fps = spidev->fps_frames;
+		spidev->fps_frames = 0;
+		spidev->fps_start = jiffies;
+	}
+	return retValue;
+}
+
+/***********************************************************************
+* frames_show / fps_show - sysfs attributes reporting the number of
+* 	frames sent to the display and the frames sent in the last second.
+***********************************************************************/
+static ssize_t frames_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct spidev_data *spidev = dev_get_drvdata(dev);
+	return sprintf(buf, "%lu\n", spidev->frames);
+}
+
+static ssize_t fps_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct spidev_data *spidev = dev_get_drvdata(dev);
+	/* A stale window means the display has been idle */
+	if(time_after_eq(jiffies, spidev->fps_start + 2 * HZ))
+	{
+		return sprintf(buf, "0\n");
+	}
+	return sprintf(buf, "%lu\n", spidev->fps);
+}
+
+static ssize_t rows_skipped_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct spidev_data *spidev = dev_get_drvdata(dev);
+	return sprintf(buf, "%lu\n", spidev->rows_skipped);
+}
+
+static ssize_t jitter_min_ns_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct spidev_data *spidev = dev_get_drvdata(dev);
+	return sprintf(buf, "%lld\n", (long long)spidev->jitter_min);
+}
+
+static ssize_t jitter_max_ns_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct spidev_data *spidev = dev_get_drvdata(dev);
+	return sprintf(buf, "%lld\n", (long long)spidev->jitter_max);
+}
+
+static int spi_led_cmp_u32(const void *a, const void *b)
+{
+	u32 x = *(const u32 *)a, y = *(const u32 *)b;
+	return (x > y) - (x < y);
+}
+
+/***********************************************************************
+* jitter_p99_ns_show - sysfs attribute reporting the 99th percentile of
+* 	the absolute frame jitter over the last SPI_LED_JITTER_SAMPLES frames.
+***********************************************************************/
+static ssize_t jitter_p99_ns_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct spidev_data *spidev = dev_get_drvdata(dev);
+	u32 *samples;
+	unsigned int count;
+	u32 p99 = 0;
+
+	samples = kmalloc(sizeof(spidev->jitter), GFP_KERNEL);
+	if(!samples)
+	{
+		return -ENOMEM;
+	}
+	spin_lock(&spidev->stats_lock);
+	count = spidev->jitter_count;
+	memcpy(samples, spidev->jitter, sizeof(spidev->jitter));
+	spin_unlock(&spidev->stats_lock);
+
+	if(count > 0)
+	{
+		sort(samples, count, sizeof(u32), spi_led_cmp_u32, NULL);
+		p99 = samples[(count * 99 + 99) / 100 - 1];
+	}
+	kfree(samples);
+	return sprintf(buf, "%u\n", p99);
+}
+
+static DEVICE_ATTR(frames, S_IRUGO, frames_show, NULL);
+static DEVICE_ATTR(fps, S_IRUGO, fps_show, NULL);
+static DEVICE_ATTR(rows_skipped, S_IRUGO, rows_skipped_show, NULL);
+static DEVICE_ATTR(jitter_min_ns, S_IRUGO, jitter_min_ns_show, NULL);
+static DEVICE_ATTR(jitter_max_ns, S_IRUGO, jitter_max_ns_show, NULL);
+static DEVICE_ATTR(jitter_p99_ns, S_IRUGO, jitter_p99_ns_show, NULL);
+
 /***********************************************************************
 * spi_led_open - This function is called when the device is first 
 * 	opened.
@@ -105,26 +546,61 @@ static void spi_led_transfer(unsigned char ch1, unsigned char ch2)
 * 
 * Description: This function is called when the device is first 
 * 	opened. It does the initial setup needed to drive the LED Display
-* 	for further patterns to be displayed.
+* 	for further patterns to be displayed. The setup is only done by the
+* 	first open file, so that opening the device does not blank what the
+* 	other files are playing. The users count taken here
+* 	keeps the device structure alive; the transfers check under
+* 	buf_lock that the device has not been removed meanwhile.
 ***********************************************************************/
 static int spi_led_open(struct inode *inode, struct file *filp)
 {
-	unsigned char i=0;
-	busyFlag = 0;
+	struct spidev_data *spidev = NULL, *entry;
+	struct spi_led_file *file;
 	//printk("spi_led_open Start\n");
-	spi_led_transfer(0x0F, 0x01);
-	spi_led_transfer(0x0F, 0x00);
-	spi_led_transfer(0x09, 0x00);
-	spi_led_transfer(0x0A, 0x04);
-	spi_led_transfer(0x0B, 0x07);
-	spi_led_transfer(0x0C, 0x01);
-
-	//Clear the LED Display
-	for(i=1; i < 9; i++)
+	file = kzalloc(sizeof(*file), GFP_KERNEL);
+	if(!file)
 	{
-		spi_led_transfer(i, 0x00);
+		return -ENOMEM;
 	}
 	
+	mutex_lock(&device_list_lock);
+	list_for_each_entry(entry, &device_list, device_entry)
+	{
+		if(entry->devt == inode->i_rdev)
+		{
+			spidev = entry;
+			break;
+		}
+	}
+	if(spidev == NULL)
+	{
+		mutex_unlock(&device_list_lock);
+		kfree(file);
+		return -ENXIO;
+	}
+	spidev->users++;
+	mutex_unlock(&device_list_lock);
+	
+	file->spidev = spidev;
+	file->done_seen = spidev->sequences_done;
+	filp->private_data = file;
+	
+	mutex_lock(&spidev->open_lock);
+	if(spidev->opens++ == 0)
+	{
+		spi_led_transfer(spidev, 0x0F, 0x01);
+		spi_led_transfer(spidev, 0x0F, 0x00);
+		spi_led_transfer(spidev, 0x09, 0x00);
+		spi_led_transfer(spidev, 0x0A, 0x04);
+		spi_led_transfer(spidev, 0x0B, 0x07);
+		spi_led_transfer(spidev, 0x0C, 0x01);
+
+		//Clear the LED Display, its content is unknown at this point
+		spidev->shadow_valid = 0;
+		spi_led_update(spidev, NULL);
+	}
+	mutex_unlock(&spidev->open_lock);
+	
 	//printk("spi_led_open End\n");
 	return 0;
 }
@@ -139,91 +615,289 @@ static int spi_led_open(struct inode *inode, struct file *filp)
 * Returns: 0 on success
 * 
 * Description: This function is called to release all data
-* 	structures that were used up by open function.
+* 	structures that were used up by open function. The queue and the
+* 	display are shared by all the files of the device, so they are only
+* 	flushed and cleared when its last file is closed. The file keeps the
+* 	device structure alive until the end, so it is freed here if the
+* 	device was removed and this is its last file.
 ***********************************************************************/
 static int spi_led_release(struct inode *inode, struct file *filp)
 {
     int status = 0;
-    unsigned char i=0;
-    busyFlag = 0;
-    //Clear the LED Display
-	for(i=1; i < 9; i++)
+    unsigned int i=0;
+    struct spi_led_file *file = filp->private_data;
+    struct spidev_data *spidev = file->spidev;
+    
+	mutex_lock(&spidev->open_lock);
+	if(--spidev->opens == 0)
 	{
-		spi_led_transfer(i, 0x00);
+		//Stop the sequence in progress before clearing the LED Display
+		spin_lock(&spidev->q_lock);
+		spidev->q_head = spidev->q_tail = spidev->q_count = 0;
+		spin_unlock(&spidev->q_lock);
+		wake_up_interruptible(&spidev->space_wq);
+		spidev->abort = 1;
+		wake_up_interruptible(&spidev->wq);
+		mutex_lock(&spidev->play_lock);
+		spidev->abort = 0;
+		spidev->deadline = ktime_set(0, 0);
+		spi_led_update(spidev, NULL);
+		mutex_unlock(&spidev->play_lock);
 	}
+	mutex_unlock(&spidev->open_lock);
 	
-	gpio_free(GPIO42);
-	gpio_free(GPIO43);
-	gpio_free(GPIO54);
-	gpio_free(GPIO55);
+	//Give back the patterns allocated through this file
+	mutex_lock(&spidev->buf_lock);
+	for(i=SPI_LED_PATTERNS;i<pattern_pool;i++)
+	{
+		if(spidev->patterns[i].used && spidev->patterns[i].owner == filp)
+		{
+			spidev->patterns[i].used = 0;
+			spidev->patterns[i].owner = NULL;
+			spidev->patterns_used--;
+		}
+	}
+	if(spidev->spi != NULL)
+	{
+		printk("spi_led_release -- %s is closing\n", dev_name(&spidev->spi->dev));
+	}
+	mutex_unlock(&spidev->buf_lock);
 	
-	printk("spi_led_release -- spidev is closing\n");
+	mutex_lock(&device_list_lock);
+	spidev->users--;
+	if(spidev->users == 0 && spidev->spi == NULL)
+	{
+		spi_led_free_data(spidev);
+	}
+	mutex_unlock(&device_list_lock);
+	kfree(file);
 	return status;
 }
 
 /***********************************************************************
-* thread_spi_led_write - This function is called by the kthread to write
-* patterns to the LED Display.
+* spi_led_sleep_until - This function is used to wait for the scheduled
+* 	time of the next frame.
 * 
-* @data: Data POinter.
+* @spidev: Device Structure
+* @deadline: Absolute CLOCK_MONOTONIC time
 *
-* Returns: 0 on success
+* Returns: 0 when the deadline was reached, 1 if playback was aborted
 * 
-* Description:  This function is called by the kthread to write
-* patterns to the LED Display.
+* Description: This function sleeps on a high resolution timer set to
+* 	the absolute deadline, so that waking up late for one frame does not
+* 	delay the frames after it. It sleeps on the device wait queue so
+* 	that a sequence can be cut short when the device is closed or
+* 	removed.
 ***********************************************************************/
-int thread_spi_led_write(void *data)
+static int spi_led_sleep_until(struct spidev_data *spidev, ktime_t deadline)
 {
-	int i=0, j=0, k=0;
-	//printk("\n\n thread_spi_led_write \n\n");
+	DEFINE_WAIT(wait);
+	int aborted = 0;
+
+	while(1)
+	{
+		prepare_to_wait(&spidev->wq, &wait, TASK_INTERRUPTIBLE);
+		if(spidev->abort || kthread_should_stop())
+		{
+			aborted = 1;
+			break;
+		}
+		/* Woken early by a new submission, go back to sleep */
+		if(schedule_hrtimeout_range(&deadline, SPI_LED_TIMER_SLACK_NS, HRTIMER_MODE_ABS) == 0)
+		{
+			break;
+		}
+	}
+	finish_wait(&spidev->wq, &wait);
+	return aborted;
+}
+
+/***********************************************************************
+* spi_led_record_jitter - This function is used to record how late a
+* 	frame reached the LED Display.
+* 
+* @spidev: Device Structure
+* @scheduled: Time the frame was due
+* @actual: Time the frame was latched by the display
+*
+* Returns: -
+***********************************************************************/
+static void spi_led_record_jitter(struct spidev_data *spidev, ktime_t scheduled, ktime_t actual)
+{
+	s64 jitter = ktime_to_ns(ktime_sub(actual, scheduled));
+
+	spin_lock(&spidev->stats_lock);
+	if(spidev->jitter_count == 0 || jitter < spidev->jitter_min)
+	{
+		spidev->jitter_min = jitter;
+	}
+	if(spidev->jitter_count == 0 || jitter > spidev->jitter_max)
+	{
+		spidev->jitter_max = jitter;
+	}
+	if(jitter < 0)
+	{
+		jitter = -jitter;
+	}
+	spidev->jitter[spidev->jitter_next] = (jitter > UINT_MAX) ? UINT_MAX : (u32)jitter;
+	spidev->jitter_next = (spidev->jitter_next + 1) % SPI_LED_JITTER_SAMPLES;
+	if(spidev->jitter_count < SPI_LED_JITTER_SAMPLES)
+	{
+		spidev->jitter_count++;
+	}
+	spin_unlock(&spidev->stats_lock);
+}
+
+/***********************************************************************
+* spi_led_play_sequence - This function is used to write the patterns of
+* 	the current sequence to the LED Display.
+* 
+* @spidev: Device Structure
+*
+* Returns: -
+* 
+* Description: This function walks sequence_buffer and shows each
+* 	pattern for its display time until a (0,0) entry is found. Frame
+* 	deadlines are absolute, each one is the previous deadline plus the
+* 	previous display time, so errors do not build up across frames.
+***********************************************************************/
+static void spi_led_play_sequence(struct spidev_data *spidev)
+{
+	int j=0;
+	unsigned int handle;
+	ktime_t now = ktime_get();
+	
+	/* Idle display, start the timeline now */
+	if(ktime_to_ns(spidev->deadline) < ktime_to_ns(now))
+	{
+		spidev->deadline = now;
+	}
 	
-	if(spidev_global->sequence_buffer[0][0] == 0 && spidev_global->sequence_buffer[0][1] == 0)
+	if(spidev->sequence_buffer[0][0] == 0 && spidev->sequence_buffer[0][1] == 0)
 	{
-		for(k=1; k < 9; k++)
+		if(spi_led_sleep_until(spidev, spidev->deadline) == 0)
 		{
-			spi_led_transfer(k, 0x00);
+			spi_led_update(spidev, NULL);
 		}
-		busyFlag = 0;
-		goto sequenceEnd;
+		return;
 	}
 				
 	//If sequence pattern followed by 0,0 is present, then display the pattern in loop upto 0,0.
-	for(j=0;j<10;j++) //loop for sequence order
+	for(j=0;j<SPI_LED_SEQUENCE_LEN;j++) //loop for sequence order
 	{
-		for(i=0;i<10;i++)//loop for pattern number
+		handle = spidev->sequence_buffer[j][0];
+		if(handle == 0 && spidev->sequence_buffer[j][1] == 0)
 		{
-			if(spidev_global->sequence_buffer[j][0] == i)
-			{
-				if(spidev_global->sequence_buffer[j][0] == 0 && spidev_global->sequence_buffer[j][1] == 0)
-				{
-					/*
-					for(k=1; k < 9; k++)
-					{
-						spi_led_transfer(k, 0x00);
-					}
-					* */
-					busyFlag = 0;
-					goto sequenceEnd;
-				}
-				else
-				{
-					spi_led_transfer(0x01, spidev_global->pattern_buffer[i][0]);
-					spi_led_transfer(0x02, spidev_global->pattern_buffer[i][1]);
-					spi_led_transfer(0x03, spidev_global->pattern_buffer[i][2]);
-					spi_led_transfer(0x04, spidev_global->pattern_buffer[i][3]);
-					spi_led_transfer(0x05, spidev_global->pattern_buffer[i][4]);
-					spi_led_transfer(0x06, spidev_global->pattern_buffer[i][5]);
-					spi_led_transfer(0x07, spidev_global->pattern_buffer[i][6]);
-					spi_led_transfer(0x08, spidev_global->pattern_buffer[i][7]);
-					msleep(spidev_global->sequence_buffer[j][1]);
-				}
-			}
+			return;
+		}
+		if(spi_led_sleep_until(spidev, spidev->deadline))
+		{
+			return;
+		}
+		//Entries naming a free handle are skipped
+		if(spi_led_show_pattern(spidev, handle) == -ENOENT)
+		{
+			continue;
 		}
+		spi_led_record_jitter(spidev, spidev->deadline, ktime_get());
+		spidev->deadline = ktime_add_ns(spidev->deadline,
+			(u64)spidev->sequence_buffer[j][1] * NSEC_PER_MSEC);
+	}
+}
+
+/***********************************************************************
+* spi_led_dequeue - This function is used to take the oldest submitted
+* 	sequence off the queue.
+* 
+* @spidev: Device Structure
+*
+* Returns: 1 if a sequence was copied into sequence_buffer, else 0
+***********************************************************************/
+static int spi_led_dequeue(struct spidev_data *spidev)
+{
+	int found = 0;
+
+	spin_lock(&spidev->q_lock);
+	if(spidev->q_count > 0)
+	{
+		memcpy(spidev->sequence_buffer, spidev->queue[spidev->q_tail].entry, sizeof(spidev->sequence_buffer));
+		spidev->q_tail = (spidev->q_tail + 1) % queue_depth;
+		spidev->q_count--;
+		found = 1;
+	}
+	spin_unlock(&spidev->q_lock);
+	if(found)
+	{
+		wake_up_interruptible(&spidev->space_wq);
+	}
+	return found;
+}
+
+/***********************************************************************
+* spi_led_enqueue - This function is used to append a sequence to the
+* 	playback queue.
+* 
+* @spidev: Device Structure
+* @sequence: Sequence to append
+*
+* Returns: 1 if the sequence was queued, 0 if the queue is full
+***********************************************************************/
+static int spi_led_enqueue(struct spidev_data *spidev, const struct spi_led_sequence *sequence)
+{
+	int queued = 0;
+
+	spin_lock(&spidev->q_lock);
+	if(spidev->q_count < queue_depth)
+	{
+		spidev->queue[spidev->q_head] = *sequence;
+		spidev->q_head = (spidev->q_head + 1) % queue_depth;
+		spidev->q_count++;
+		queued = 1;
+	}
+	spin_unlock(&spidev->q_lock);
+	if(queued)
+	{
+		wake_up_interruptible(&spidev->wq);
+	}
+	return queued;
+}
+
+/***********************************************************************
+* thread_spi_led_write - This is the playback kthread of the LED Display.
+* 
+* @data: Device Structure.
+*
+* Returns: 0 on success
+* 
+* Description: This kthread is created once at probe time. It sleeps on
+* 	the device wait queue until spi_led_write() queues a sequence,
+* 	plays the queued sequences in order and goes back to sleep. It
+* 	exits when the device is removed.
+***********************************************************************/
+int thread_spi_led_write(void *data)
+{
+	struct spidev_data *spidev = data;
+	//printk("\n\n thread_spi_led_write \n\n");
+	
+	while(!kthread_should_stop())
+	{
+		wait_event_interruptible(spidev->wq, spidev->q_count > 0 || kthread_should_stop());
+		if(kthread_should_stop())
+		{
+			break;
+		}
+		mutex_lock(&spidev->play_lock);
+		if(spi_led_dequeue(spidev))
+		{
+			spi_led_play_sequence(spidev);
+			spidev->sequences_done++;
+			wake_up_interruptible(&spidev->done_wq);
+		}
+		mutex_unlock(&spidev->play_lock);
 	}
-	sequenceEnd:
-	busyFlag = 0;
 	return 0;
 }
+
 /***********************************************************************
 * spi_led_write - This function is used to send data over SPI bus to the
 * 	LED Display.
@@ -233,89 +907,364 @@ int thread_spi_led_write(void *data)
 * @count: Size of Buffer
 * @ppos: Position Pointer
 *
-* Returns: 0 on success
+* Returns: Number of bytes queued on success
 * 
 * Description: This function is used to send data over SPI bus to the
-* 	LED Display.
+* 	LED Display. The sequence is appended to the playback queue and the
+* 	call returns at once. It only blocks, or fails with -EAGAIN under
+* 	O_NONBLOCK, when the queue is full.
 ***********************************************************************/
 static ssize_t spi_led_write(struct file *filp, const char *buf, size_t count, loff_t *ppos)
 {
-	int retValue = 0, i=0, j=0;
-	unsigned  int sequenceBuffer[20];
-	struct task_struct *task;
+	int retValue = 0;
+	struct spi_led_file *file = filp->private_data;
+	struct spidev_data *spidev = file->spidev;
+	struct spi_led_sequence sequence;
 	//printk("\n\n spi_led_write \n\n");
-	/* chipselect only toggles at start or end of operation */
-	if(busyFlag == 1)
-	{
-		return -EBUSY;
-	}
-	if (count > bufsiz)
+	
+	if(spidev->spi == NULL)
 	{
-		return -EMSGSIZE;
+		return -ESHUTDOWN;
 	}
-	retValue = copy_from_user((void *)&sequenceBuffer, (void * __user)buf, sizeof(sequenceBuffer));
-	for(i=0;i<20;i=i+2)
+	
+	/* Entries not supplied by the user read as the (0,0) terminator */
+	memset(&sequence, 0, sizeof(sequence));
+	if(count > sizeof(sequence))
 	{
-		j=i/2;
-		spidev_global->sequence_buffer[j][0] = sequenceBuffer[i];
-		spidev_global->sequence_buffer[j][1] = sequenceBuffer[i+1];
+		count = sizeof(sequence);
 	}
+	retValue = copy_from_user((void *)&sequence, (void * __user)buf, count);
 	if(retValue != 0)
 	{
 		printk("Failure : %d number of bytes that could not be copied.\n",retValue);
+		return -EFAULT;
 	}
 	
-	busyFlag = 1;
+	while(!spi_led_enqueue(spidev, &sequence))
+	{
+		if(filp->f_flags & O_NONBLOCK)
+		{
+			return -EAGAIN;
+		}
+		retValue = wait_event_interruptible(spidev->space_wq, spidev->q_count < queue_depth || spidev->spi == NULL);
+		if(retValue)
+		{
+			return retValue;
+		}
+		if(spidev->spi == NULL)
+		{
+			return -ESHUTDOWN;
+		}
+	}
+
+	return count;
+}
 
-    task = kthread_run(&thread_spi_led_write, (void *)sequenceBuffer,"kthread_spi_led");
+/***********************************************************************
+* spi_led_read - This function is used to wait for queued sequences to
+* 	finish playing.
+* 
+* @filp: File Pointer.
+* @buf: Buffer
+* @count: Size of Buffer
+* @ppos: Position Pointer
+*
+* Returns: sizeof(__u32) on success
+* 
+* Description: This function returns, as a __u32, the number of
+* 	sequences that finished since the last read() on this file. It
+* 	blocks until at least one has finished, or fails with -EAGAIN under
+* 	O_NONBLOCK, and with -ESHUTDOWN once the device is removed.
+***********************************************************************/
+static ssize_t spi_led_read(struct file *filp, char *buf, size_t count, loff_t *ppos)
+{
+	struct spi_led_file *file = filp->private_data;
+	struct spidev_data *spidev = file->spidev;
+	unsigned long done;
+	__u32 finished;
+	int retValue = 0;
 
-	return retValue;
+	if(count < sizeof(finished))
+	{
+		return -EINVAL;
+	}
+	while((done = spidev->sequences_done) == file->done_seen)
+	{
+		if(filp->f_flags & O_NONBLOCK)
+		{
+			return -EAGAIN;
+		}
+		if(spidev->spi == NULL)
+		{
+			return -ESHUTDOWN;
+		}
+		retValue = wait_event_interruptible(spidev->done_wq, spidev->sequences_done != file->done_seen || spidev->spi == NULL);
+		if(retValue)
+		{
+			return retValue;
+		}
+	}
+	finished = done - file->done_seen;
+	file->done_seen = done;
+	if(copy_to_user((void * __user)buf, &finished, sizeof(finished)))
+	{
+		return -EFAULT;
+	}
+	return sizeof(finished);
 }
 
 /***********************************************************************
-* spi_led_ioctl - This function is used to set the buffer with user
-* 	defined patterns.
+* spi_led_poll - This function is used by poll() and select() on the
+* 	LED Display.
+* 
+* @filp: File Pointer.
+* @wait: Poll Table
+*
+* Returns: Poll Mask
+* 
+* Description: POLLOUT is raised while the playback queue can take
+* 	another sequence, POLLIN once a sequence has finished since the last
+* 	read(). Only POLLERR is raised once the device is removed.
+***********************************************************************/
+static unsigned int spi_led_poll(struct file *filp, poll_table *wait)
+{
+	struct spi_led_file *file = filp->private_data;
+	struct spidev_data *spidev = file->spidev;
+	unsigned int mask = 0;
+
+	poll_wait(filp, &spidev->space_wq, wait);
+	poll_wait(filp, &spidev->done_wq, wait);
+	if(spidev->spi == NULL)
+	{
+		return POLLERR;
+	}
+	if(spidev->q_count < queue_depth)
+	{
+		mask |= POLLOUT | POLLWRNORM;
+	}
+	if(spidev->sequences_done != file->done_seen)
+	{
+		mask |= POLLIN | POLLRDNORM;
+	}
+	return mask;
+}
+
+/***********************************************************************
+* spi_led_ioctl - This function is used to manage the patterns of the
+* 	LED Display.
 * 
 * @filp: File Pointer.
-* @arg: Input Arguments
 * @cmd: Command
+* @arg: Input Arguments
 *
 * Returns: 0 on success
 * 
 * Description: This function is used to set the buffer with user
-* 	defined patterns.
+* 	defined patterns. SPI_LED_IOC_SET_PATTERNS copies the first
+* 	SPI_LED_PATTERNS patterns, of pattern_size bytes each, from the user
+* 	buffer described by a struct spi_led_patterns. It fails with EINVAL
+* 	if the buffer does not hold exactly that many bytes and loads none of
+* 	them if the copy faults. SPI_LED_IOC_COMMIT loads
+* 	a pattern that user space has changed in place through mmap(). The
+* 	other commands allocate, free, write and read single patterns of the
+* 	pattern pool by handle.
 ***********************************************************************/
-static long spi_led_ioctl(struct file *filp, unsigned int arg, unsigned long cmd)
+static long spi_led_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
-	int i=0, j=0;
-	char writeBuffer[10][8];
-	int retValue;
+	int i=0;
+	int retValue=0;
+	struct spi_led_file *file = filp->private_data;
+	struct spidev_data *spidev = file->spidev;
+	__u32 handle;
+	struct spi_led_pattern_io patternIo;
+	struct spi_led_info info;
+	struct spi_led_patterns patterns;
+	char *rows;
     //printk("spi_led_ioctl Start\n");
-	retValue = copy_from_user((void *)&writeBuffer, (void * __user)arg, sizeof(writeBuffer));
-	if(retValue != 0)
-	{
-		printk("Failure : %d number of bytes that could not be copied.\n",retValue);
-	}
-	for(i=0;i<10;i++)
+	switch(cmd)
 	{
-		for(j=0;j<8;j++)
+	case SPI_LED_IOC_SET_PATTERNS:
+		if(copy_from_user(&patterns, (void * __user)arg, sizeof(patterns)))
+		{
+			return -EFAULT;
+		}
+		if(patterns.len != SPI_LED_PATTERNS * spidev->pattern_size || patterns.reserved != 0)
+		{
+			return -EINVAL;
+		}
+		//Copy aside first, a faulting buffer leaves the patterns untouched
+		rows = kmalloc(patterns.len, GFP_KERNEL);
+		if(!rows)
+		{
+			return -ENOMEM;
+		}
+		retValue = copy_from_user(rows, (void * __user)(unsigned long)patterns.ptr, patterns.len);
+		if(retValue != 0)
+		{
+			printk("Failure : %d number of bytes that could not be copied.\n",retValue);
+			kfree(rows);
+			return -EFAULT;
+		}
+		mutex_lock(&spidev->buf_lock);
+		memcpy(spidev->pattern_bank, rows, patterns.len);
+		kfree(rows);
+		for(i=0;i<SPI_LED_PATTERNS;i++)
+		{
+			spi_led_commit_pattern(spidev, i);
+		}
+		mutex_unlock(&spidev->buf_lock);
+		break;
+	case SPI_LED_IOC_COMMIT:
+		if(arg >= pattern_pool)
+		{
+			return -EINVAL;
+		}
+		mutex_lock(&spidev->buf_lock);
+		if(!spidev->patterns[arg].used)
+		{
+			retValue = -ENOENT;
+		}
+		else
+		{
+			spi_led_commit_pattern(spidev, arg);
+		}
+		mutex_unlock(&spidev->buf_lock);
+		break;
+	case SPI_LED_IOC_ALLOC:
+		mutex_lock(&spidev->buf_lock);
+		retValue = spi_led_new_handle(spidev, pattern_pool);
+		if(retValue >= 0)
+		{
+			spidev->patterns[retValue].owner = filp;
+		}
+		mutex_unlock(&spidev->buf_lock);
+		if(retValue >= 0)
+		{
+			handle = retValue;
+			retValue = put_user(handle, (__u32 __user *)arg);
+		}
+		break;
+	case SPI_LED_IOC_FREE:
+		if(get_user(handle, (__u32 __user *)arg))
+		{
+			return -EFAULT;
+		}
+		//The patterns loaded by SPI_LED_IOC_SET_PATTERNS always stay allocated
+		if(handle < SPI_LED_PATTERNS || handle >= pattern_pool)
+		{
+			return -EINVAL;
+		}
+		mutex_lock(&spidev->buf_lock);
+		if(!spidev->patterns[handle].used)
+		{
+			retValue = -ENOENT;
+		}
+		else if(spidev->patterns[handle].owner != filp)
+		{
+			//Only the file that allocated a handle can give it back
+			retValue = -EPERM;
+		}
+		else
+		{
+			spidev->patterns[handle].used = 0;
+			spidev->patterns[handle].owner = NULL;
+			spidev->patterns_used--;
+		}
+		mutex_unlock(&spidev->buf_lock);
+		break;
+	case SPI_LED_IOC_SET_PATTERN:
+	case SPI_LED_IOC_GET_PATTERN:
+		if(copy_from_user(&patternIo, (void * __user)arg, sizeof(patternIo)))
+		{
+			return -EFAULT;
+		}
+		if(patternIo.handle >= pattern_pool || patternIo.module >= spidev->modules)
 		{
-			spidev_global->pattern_buffer[i][j] = writeBuffer[i][j];
+			return -EINVAL;
 		}
+		mutex_lock(&spidev->buf_lock);
+		if(!spidev->patterns[patternIo.handle].used)
+		{
+			retValue = -ENOENT;
+		}
+		else if(cmd == SPI_LED_IOC_SET_PATTERN)
+		{
+			memcpy(spidev->pattern_bank + patternIo.handle * spidev->pattern_size
+				+ patternIo.module * SPI_LED_ROWS, patternIo.rows, SPI_LED_ROWS);
+			spi_led_commit_pattern(spidev, patternIo.handle);
+		}
+		else
+		{
+			memcpy(patternIo.rows, spidev->pattern_bank + patternIo.handle * spidev->pattern_size
+				+ patternIo.module * SPI_LED_ROWS, SPI_LED_ROWS);
+		}
+		mutex_unlock(&spidev->buf_lock);
+		if(retValue == 0 && cmd == SPI_LED_IOC_GET_PATTERN)
+		{
+			if(copy_to_user((void * __user)arg, &patternIo, sizeof(patternIo)))
+			{
+				retValue = -EFAULT;
+			}
+		}
+		break;
+	case SPI_LED_IOC_INFO:
+		memset(&info, 0, sizeof(info));
+		info.pool_size = pattern_pool;
+		info.modules = spidev->modules;
+		info.pattern_size = spidev->pattern_size;
+		info.bank_size = spidev->bank_size;
+		mutex_lock(&spidev->buf_lock);
+		info.patterns_used = spidev->patterns_used;
+		mutex_unlock(&spidev->buf_lock);
+		if(copy_to_user((void * __user)arg, &info, sizeof(info)))
+		{
+			retValue = -EFAULT;
+		}
+		break;
+	default:
+		retValue = -ENOTTY;
+		break;
 	}
 	//printk("spi_led_ioctl End\n");
 	return retValue;
 }
 
+/***********************************************************************
+* spi_led_mmap - This function is used to map the pattern bank into user
+* 	space.
+* 
+* @filp: File Pointer.
+* @vma: User Mapping
+*
+* Returns: 0 on success
+* 
+* Description: This function maps the pattern bank so that user space
+* 	can change patterns in place and only issue SPI_LED_IOC_COMMIT.
+***********************************************************************/
+static int spi_led_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct spi_led_file *file = filp->private_data;
+	struct spidev_data *spidev = file->spidev;
+
+	if(vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > spidev->bank_size)
+	{
+		return -EINVAL;
+	}
+	return remap_vmalloc_range(vma, spidev->pattern_bank, 0);
+}
+
 /***********************************************************************
 * Driver entry points 
 ***********************************************************************/
 static struct file_operations spi_led_fops = {
   .owner   			= THIS_MODULE,
   .write   			= spi_led_write,
+  .read				= spi_led_read,
+  .poll				= spi_led_poll,
   .open    			= spi_led_open,
   .release 			= spi_led_release,
   .unlocked_ioctl   = spi_led_ioctl,
+  .mmap				= spi_led_mmap,
 };
 
 /***********************************************************************
@@ -331,36 +1280,103 @@ static struct file_operations spi_led_fops = {
 ***********************************************************************/
 static int spidev_probe(struct spi_device *spi)
 {
-	//struct spidev_data *spidev;
+	struct spidev_data *spidev;
 	int status = 0;
+	unsigned long minor;
 	struct device *dev;
 
 	/* Allocate driver data */
-	spidev_global = kzalloc(sizeof(*spidev_global), GFP_KERNEL);
-	if(!spidev_global)
+	spidev = kzalloc(sizeof(*spidev), GFP_KERNEL);
+	if(!spidev)
 	{
 		return -ENOMEM;
 	}
 
 	/* Initialize the driver data */
-	spidev_global->spi = spi;
+	spidev->spi = spi;
+	INIT_LIST_HEAD(&spidev->device_entry);
+	mutex_init(&spidev->buf_lock);
+	mutex_init(&spidev->open_lock);
+	mutex_init(&spidev->play_lock);
+	init_waitqueue_head(&spidev->wq);
+	init_waitqueue_head(&spidev->space_wq);
+	init_waitqueue_head(&spidev->done_wq);
+	spin_lock_init(&spidev->q_lock);
+	spin_lock_init(&spidev->stats_lock);
+	spidev->fps_start = jiffies;
+
+	spidev->queue = kcalloc(queue_depth, sizeof(struct spi_led_sequence), GFP_KERNEL);
+	spidev->modules = modules;
+	spidev->pattern_size = SPI_LED_ROWS * modules;
+	spidev->row_len = 2 * modules;
+	spidev->bank_size = PAGE_ALIGN(pattern_pool * spidev->pattern_size);
+	spidev->pattern_bank = vmalloc_user(spidev->bank_size);
+	spidev->pattern_rows = vzalloc(pattern_pool * spidev->pattern_size);
+	spidev->patterns = kcalloc(pattern_pool, sizeof(struct spi_led_pattern), GFP_KERNEL);
+	if(!spidev->queue || !spidev->pattern_bank || !spidev->pattern_rows || !spidev->patterns)
+	{
+		spi_led_free_data(spidev);
+		return -ENOMEM;
+	}
 
-	spidev_global->devt = MKDEV(MAJOR_NUMBER, MINOR_NUMBER);
+	status = spi_led_build_messages(spidev);
+	if(status < 0)
+	{
+		printk("SPI Message Allocation Failed\n");
+		spi_led_free_data(spidev);
+		return status;
+	}
+
+	/* Take a free minor and create the device node for it */
+	mutex_lock(&device_list_lock);
+	minor = find_first_zero_bit(minors, N_SPI_MINORS);
+	if(minor >= N_SPI_MINORS)
+	{
+		mutex_unlock(&device_list_lock);
+		printk("No Minor Number Available\n");
+		spi_led_free_data(spidev);
+		return -ENODEV;
+	}
+	spidev->devt = MKDEV(spi_led_major, minor);
 
-    dev = device_create(spi_led_class, &spi->dev, spidev_global->devt, spidev_global, DEVICE_NAME);
+    dev = device_create(spi_led_class, &spi->dev, spidev->devt, spidev, DEVICE_NAME, spi->master->bus_num, spi->chip_select);
 
-    if(dev == NULL)
+    if(IS_ERR_OR_NULL(dev))
     {
+		mutex_unlock(&device_list_lock);
 		printk("Device Creation Failed\n");
-		kfree(spidev_global);
-		return -1;
+		spi_led_free_data(spidev);
+		return -ENODEV;
+	}
+	device_create_file(dev, &dev_attr_frames);
+	device_create_file(dev, &dev_attr_fps);
+	device_create_file(dev, &dev_attr_rows_skipped);
+	device_create_file(dev, &dev_attr_jitter_min_ns);
+	device_create_file(dev, &dev_attr_jitter_max_ns);
+	device_create_file(dev, &dev_attr_jitter_p99_ns);
+
+	spidev->task = kthread_run(&thread_spi_led_write, (void *)spidev, "kthread_spi_led%d.%d",
+		spi->master->bus_num, spi->chip_select);
+	if(IS_ERR(spidev->task))
+	{
+		mutex_unlock(&device_list_lock);
+		printk("Playback Thread Creation Failed\n");
+		status = PTR_ERR(spidev->task);
+		device_destroy(spi_led_class, spidev->devt);
+		spi_led_free_data(spidev);
+		return status;
 	}
-	printk("SPI LED Driver Probed.\n");
+	set_bit(minor, minors);
+	list_add(&spidev->device_entry, &device_list);
+	mutex_unlock(&device_list_lock);
+
+	spi_set_drvdata(spi, spidev);
+	printk("SPI LED Driver Probed %s.\n", dev_name(dev));
 	return status;
 }
 
 /***********************************************************************
-* spidev_probe - This is the remove function. It gets called when device
+* spidev_remove - This is the remove function. It gets called when device
 * 	is disconnected.
 * 
 * @spi: SPI Device Structure
@@ -369,14 +1385,33 @@ static int spidev_probe(struct spi_device *spi)
 * 
 * Description: This is the remove function. It gets called when device
 * 	is disconnected. So all the data structures that was allocated to it
-* 	needs to be freed.
+* 	needs to be freed. If the device is still open, they are freed by
+* 	the last release instead, and the writers and readers sleeping on
+* 	the device are woken up to fail with -ESHUTDOWN.
 ***********************************************************************/
 static int spidev_remove(struct spi_device *spi)
 {
 	int retValue=0;
+	struct spidev_data *spidev = spi_get_drvdata(spi);
 	
-	device_destroy(spi_led_class, spidev_global->devt);
-	kfree(spidev_global);
+	kthread_stop(spidev->task);
+
+	mutex_lock(&device_list_lock);
+	//Wait for a transfer in progress, then refuse the next ones
+	mutex_lock(&spidev->buf_lock);
+	spidev->spi = NULL;
+	mutex_unlock(&spidev->buf_lock);
+	wake_up_interruptible_all(&spidev->space_wq);
+	wake_up_interruptible_all(&spidev->done_wq);
+	spi_set_drvdata(spi, NULL);
+	list_del(&spidev->device_entry);
+	device_destroy(spi_led_class, spidev->devt);
+	clear_bit(MINOR(spidev->devt), minors);
+	if(spidev->users == 0)
+	{
+		spi_led_free_data(spidev);
+	}
+	mutex_unlock(&device_list_lock);
 	printk("SPI LED Driver Removed.\n");
 	return retValue;
 }
@@ -404,9 +1439,23 @@ static int __init spi_led_init(void)
 {
 	int retValue;
 	
-	//Register the Device
-	retValue = register_chrdev(MAJOR_NUMBER, DEVICE_NAME, &spi_led_fops);
-	if(retValue < 0)
+	if(queue_depth == 0)
+	{
+		queue_depth = 1;
+	}
+	if(pattern_pool < SPI_LED_PATTERNS)
+	{
+		pattern_pool = SPI_LED_PATTERNS;
+	}
+	if(modules == 0 || modules > SPI_LED_MAX_MODULES)
+	{
+		printk("modules must be between 1 and %d\n", SPI_LED_MAX_MODULES);
+		return -EINVAL;
+	}
+	
+	//Register the Device, with a dynamically allotted major number
+	spi_led_major = register_chrdev(0, DRIVER_NAME, &spi_led_fops);
+	if(spi_led_major < 0)
 	{
 		printk("Device Registration Failed\n");
 		return -1;
@@ -417,7 +1466,7 @@ static int __init spi_led_init(void)
 	if(spi_led_class == NULL)
 	{
 		printk("Class Creation Failed\n");
-		unregister_chrdev(MAJOR_NUMBER, spi_led_driver.driver.name);
+		unregister_chrdev(spi_led_major, spi_led_driver.driver.name);
 		return -1;
 	}
 	
@@ -427,7 +1476,7 @@ static int __init spi_led_init(void)
 	{
 		printk("Driver Registraion Failed\n");
 		class_destroy(spi_led_class);
-		unregister_chrdev(MAJOR_NUMBER, spi_led_driver.driver.name);
+		unregister_chrdev(spi_led_major, spi_led_driver.driver.name);
 		return -1;
 	}
 	
@@ -466,7 +1515,11 @@ static void __exit spi_led_exit(void)
 {
 	spi_unregister_driver(&spi_led_driver);
 	class_destroy(spi_led_class);
-	unregister_chrdev(MAJOR_NUMBER, spi_led_driver.driver.name);
+	gpio_free(GPIO42);
+	gpio_free(GPIO43);
+	gpio_free(GPIO54);
+	gpio_free(GPIO55);
+	unregister_chrdev(spi_led_major, spi_led_driver.driver.name);
 	printk("SPI LED Driver Uninitialized.\n");
 }
 
@@ -0,0 +1,94 @@
+/***********************************************************************
+ *
+ * File Name: spi_led.h
+ *
+ * Author: Ankit Rathi (ASU ID: 1207543476)
+ * 			(Ankit.Rathi@asu.edu)
+ *
+ * Date: 30-OCT-2014
+ *
+ * Description: Interface of the SPI LED display driver shared by
+ * 			spi_led.c and the user space programs.
+ *
+ **********************************************************************/
+
+#ifndef SPI_LED_H
+#define SPI_LED_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/**
+ * Define constants using the macro
+ */
+#define SPI_LED_PATTERNS	10		/* Handles loaded by SPI_LED_IOC_SET_PATTERNS */
+#define SPI_LED_ROWS		8		/* Digit registers per MAX7219 */
+
+/**
+ * A display is a chain of one or more MAX7219 modules on one chip
+ * select, set with the modules module parameter. A pattern covers the
+ * whole chain: SPI_LED_ROWS bytes for module 0 (the one wired to the
+ * SPI bus), then SPI_LED_ROWS bytes for module 1 and so on. Its size is
+ * reported by SPI_LED_IOC_INFO as pattern_size.
+ *
+ * Patterns are referred to by handle, from 0 to the pattern_pool module
+ * parameter minus one. Handles 0 to SPI_LED_PATTERNS - 1 are always
+ * allocated; the others are taken with SPI_LED_IOC_ALLOC and given back
+ * by the file that allocated them with SPI_LED_IOC_FREE, or when it is
+ * closed.
+ * Sequences written to the device name patterns by handle.
+ *
+ * The pattern bank can be mapped with mmap() at offset 0. Pattern N
+ * starts at byte N * pattern_size. After changing a pattern in place,
+ * SPI_LED_IOC_COMMIT with N as argument makes the driver pick it up.
+ */
+struct spi_led_pattern_io {
+	__u32 handle;
+	__u32 module;			/* Module of the chain the rows belong to */
+	__u8 rows[SPI_LED_ROWS];
+};
+
+/**
+ * Argument of SPI_LED_IOC_SET_PATTERNS. len must be SPI_LED_PATTERNS *
+ * pattern_size, pattern_size as reported by SPI_LED_IOC_INFO. The
+ * padding keeps the layout the same for 32 and 64 bit user space.
+ */
+struct spi_led_patterns {
+	__u32 len;				/* Bytes at ptr */
+	__u32 reserved;			/* 0 */
+	__u64 ptr;				/* Address of the rows of patterns 0 to SPI_LED_PATTERNS - 1 */
+};
+
+struct spi_led_info {
+	__u32 pool_size;		/* Number of handles */
+	__u32 patterns_used;	/* Handles currently allocated */
+	__u32 modules;			/* Modules in the chain */
+	__u32 pattern_size;		/* Bytes per pattern */
+	__u32 bank_size;		/* Bytes that can be mapped with mmap() */
+};
+
+/**
+ * write() queues a sequence of (pattern handle, time in ms) pairs of
+ * unsigned int, terminated by a (0,0) pair. read() returns, as a __u32,
+ * the number of sequences finished since the last read() on the file.
+ * poll() raises POLLOUT while the queue can take a sequence and POLLIN
+ * once a sequence has finished.
+ */
+#define SPI_LED_IOC_MAGIC	'l'
+
+/* Copy patterns 0 to SPI_LED_PATTERNS - 1 from user space, EINVAL unless len matches the chain */
+#define SPI_LED_IOC_SET_PATTERNS	_IOW(SPI_LED_IOC_MAGIC, 0, struct spi_led_patterns)
+/* Load pattern handle arg from the mapped pattern bank */
+#define SPI_LED_IOC_COMMIT			_IO(SPI_LED_IOC_MAGIC, 1)
+/* Allocate a cleared pattern, its handle is returned */
+#define SPI_LED_IOC_ALLOC			_IOR(SPI_LED_IOC_MAGIC, 2, __u32)
+/* Free a pattern allocated with SPI_LED_IOC_ALLOC on the same file, EPERM otherwise */
+#define SPI_LED_IOC_FREE			_IOW(SPI_LED_IOC_MAGIC, 3, __u32)
+/* Upload or replace the rows of one module of a pattern */
+#define SPI_LED_IOC_SET_PATTERN		_IOW(SPI_LED_IOC_MAGIC, 4, struct spi_led_pattern_io)
+/* Read back the rows of one module of a pattern */
+#define SPI_LED_IOC_GET_PATTERN		_IOWR(SPI_LED_IOC_MAGIC, 5, struct spi_led_pattern_io)
+/* Size and usage of the pattern pool */
+#define SPI_LED_IOC_INFO			_IOR(SPI_LED_IOC_MAGIC, 6, struct spi_led_info)
+
+#endif /* SPI_LED_H */